@@ -7,16 +7,22 @@
 
 // Initialize the aht 'aht' to hold 'sz' leaves
 void aht_init(struct aht* aht, int sz){
-	struct aht_node* ahtn;
-	aht->tree = calloc(sz * 2, sizeof(struct aht_node));
+	aht->tree = malloc((sz * 2 + 1) * sizeof(struct aht_node)); // + 1 for the nyt node once every symbol has been seen
 	if (!aht->tree){
 		fail_out(E_MALLOC);
 	}
-	aht->score = 0;
 	aht->sz = sz;
-	aht->nyt = sz;
+	aht_reset(aht);
+}
+
+// Empty the aht 'aht' of all the symbols inserted so far
+void aht_reset(struct aht* aht){
+	struct aht_node* ahtn;
+	memset(aht->tree, 0, (aht->sz * 2 + 1) * sizeof(struct aht_node));
+	aht->score = 0;
+	aht->nyt = aht->sz;
 	
-	ahtn = aht->tree + sz;
+	ahtn = aht->tree + aht->sz;
 	ahtn->weight = 0;
 	ahtn->depth = 0;
 	ahtn->parent = ahtn->left = ahtn->right = ahtn->block_next = ahtn->block_prev = -1;
@@ -317,7 +323,7 @@ void aht_print_helper(const struct aht* aht, struct aht_node* ahtn, char* bm, in
 }
 
 void aht_print(const struct aht* aht){
-	char* bm = calloc(aht->sz * 2, sizeof(char));
+	char* bm = calloc(aht->sz * 2 + 1, sizeof(char));
 	if (!bm)
 		fail_out(E_MALLOC);
 	
@@ -0,0 +1,85 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include "include/globals.h"
+#include "include/global_errors.h"
+#include "include/bit_writer.h"
+
+// Initialize the bit writer 'bw' to write to 'fd'
+void bit_writer_init(struct bit_writer* bw, int fd){
+	if (!(bw->buf = malloc(BIT_WRITER_BUF_SZ))){
+		fail_out(E_MALLOC);
+	}
+	bw->acc = 0;
+	bw->n = 0;
+	bw->fd = fd;
+	bw->pos = 0;
+	bw->cap = BIT_WRITER_BUF_SZ;
+	bw->fixed = 0;
+	bw->total = 0;
+}
+
+// Initialize the bit writer 'bw' to write to the 'cap' bytes at 'buf', with no fd; it fails with E_SZ once they are full
+void bit_writer_init_buf(struct bit_writer* bw, unsigned char* buf, size_t cap){
+	bw->buf = buf;
+	bw->acc = 0;
+	bw->n = 0;
+	bw->fd = -1;
+	bw->pos = 0;
+	bw->cap = cap;
+	bw->fixed = 1;
+	bw->total = 0;
+}
+
+// Deinitialize the bit writer 'bw'; pending bits are not written (see bit_writer_align and bit_writer_flush)
+void bit_writer_deinit(struct bit_writer* bw){
+	if (bw->fixed){
+		bw->buf = NULL;
+	}
+	freec(bw->buf);
+}
+
+/* Write the whole bytes stored in the output buffer of 'bw' to its fd; with no fd, make room for more in the buffer instead,
+	unless it is fixed
+*/
+void bit_writer_flush(struct bit_writer* bw){
+	ssize_t ret;
+	size_t i;
+	if (bw->fd < 0){
+		if (bw->pos + sizeof(bw->acc) > bw->cap && !bw->fixed){
+			if (!(bw->buf = realloc(bw->buf, bw->cap << 1))){
+				fail_out(E_MALLOC);
+			}
+			bw->cap <<= 1;
+		}
+		return;
+	}
+	for (i = 0; i < bw->pos; i += ret){
+		ret = write(bw->fd, bw->buf + i, bw->pos - i);
+		if (ret <= 0){
+			fail_out(E_WRITE);
+		}
+	}
+	bw->total += bw->pos;
+	bw->pos = 0;
+}
+
+// Pad the pending bits of 'bw' with zeros up to a byte boundary and move them into the output buffer
+void bit_writer_align(struct bit_writer* bw){
+	if (bw->pos + sizeof(bw->acc) > bw->cap)
+		bit_writer_flush(bw);
+	bit_writer_bytes(bw, (bw->n + 7) >> 3);
+	bw->acc = 0;
+	bw->n = 0;
+}
+
+// Store the low 'n' bytes of the accumulator of 'bw' into its output buffer one at a time, failing with E_SZ once it is full
+void bit_writer_bytes(struct bit_writer* bw, int n){
+	unsigned long long acc = bw->acc;
+	for (; n > 0; n--){
+		if (bw->pos == bw->cap){ // only ever the case with a fixed buffer
+			fail_out(E_SZ);
+		}
+		bw->buf[bw->pos++] = acc & 0xff;
+		acc >>= 8;
+	}
+}
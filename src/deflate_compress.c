@@ -2,117 +2,493 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "include/globals.h"
 #include "include/deflate.h"
 #include "include/deflate_ext.h"
 #include "include/aht.h"
+#include "include/hist.h"
 #include "include/deflate_errors.h"
 #include "include/h_tree.h"
+#include "include/bit_writer.h"
+#include "include/adler32.h"
 
-#define DUP_HT_SZ 1024
+#ifndef DUP_HT_BITS
+#define DUP_HT_BITS 15 // log2 of the number of hash chains; override with -D
+#endif
+#define DUP_HT_SZ (1 << DUP_HT_BITS)
+#define TOO_FAR 4096 // a dup string of length 3 any farther away than this costs more bits than its three literals
+#define DEFLATE_BLOCK_TOKS (1 << 15) // most symbols per block, and buffered at once; keeps every frequency within an htbq weight
+#define DEFLATE_DP_TOKS (1 << 18) // symbols buffered at once with DEFLATE_DP_SPLIT (see deflate_block_plan); a multiple of DEFLATE_BLOCK_TOKS
+#define DEFLATE_DP_BYTES (1 << 21) // with DEFLATE_DP_SPLIT, the blocks are also planned once the buffered symbols cover this many chars
+#define DEFLATE_STATS_REFRESH (1 << 6) // most symbols between counts of the tree bits written to 'fd_stats' (see emit)
+#define DEFLATE_HIST_TREE_BITS 64 // DEFLATE_COST_HIST: bits of a dynamic block header short of its code lengths, about
+#define DEFLATE_HIST_LEN_BITS 4 // DEFLATE_COST_HIST: bits of the code length of each symbol that occurs in a block, about
+#define DEFLATE_SPLIT_STEP (1 << 10) // symbols between the points at which a block may end (see deflate_block_split); divides DEFLATE_BLOCK_TOKS
+#define DEFLATE_DYN_HEADER_MIN (3 + 14 + 4 * 3) // fewest bits of a dynamic block header: BFINAL, BTYPE, HLIT, HDIST, HCLEN and 4 code length code lengths
+#define DEFLATE_SPLIT_WINDOW 4 // most segments of DEFLATE_SPLIT_STEP symbols weighed together at once (see deflate_block_split)
+#define DUP_STR_SLACK 8 // bytes allocated past the spillover so that dup_str_len may read a whole word past 'bound'
+#define DEFLATE_OPT_ITERATIONS 15 // most parses of a sliding window by the optimal strategy
+#define DEFLATE_FAST_SKIP 6 // log2 of the misses in a row after which the fast strategy steps over one more char at a time
+#define DEFLATE_DICT_SEG_MIN 32 // shortest segment of the samples that a trained dictionary is made of
+#define DEFLATE_DICT_SEG_MAX 256 // longest segment of the samples that a trained dictionary is made of
+#define PL_BEGIN 0 // process_loop: nothing has been read in yet
+#define PL_RESTART 1 // process_loop: nothing has been read in since a sync flush (see deflate_compr_push)
+#define PL_WINDOWS 2 // process_loop: the input is being read in and parsed a sliding window at a time
+#define PL_DONE 3 // deflate_compr_push: the zlib trailer has been written
+#define DIST_SYM(d) (((d) <= 256)? dist_sym[(d) - 1] : dist_sym[256 + (((d) - 1) >> 7)])
 
 /*
-The data space 'd' points to a region kept at a size of 2 * 'sliding_window' + 2.
+The data space 'd' points to a region kept at a size of 2 * 'sliding_window' + MAXLEN.
 	The justification behind the size has two factors.
 		First, there are two sliding windows in order to search amongst the previous sliding window for potential dup strings.
 		Rather than reading in a new character each iteration, an entire new sliding window is read in once the current one
-			is exhausted. The two sliding windows are rotated; as the current one is being processed, the old one is being
-			overwritten one char at a time since its chars are out of range (sliding_window) for dup strings.
-		Second, the hash function uses the current char plus the two subsequent chars. Thus, in fact 'sliding_window' + 2 chars
-			must be read in so that these are present. There are 2 extra spaces ('A', 'B') after the current sliding window
-			for spillover of these two additionaly read chars.
+			is exhausted, and the current one slides down to become the former one.
+		Second, a dup string starting in the current sliding window may run up to MAXLEN chars past its end (and the hash
+			function uses the current char plus the two subsequent chars). Thus, in fact 'sliding_window' + MAXLEN chars
+			must be read in so that these are present. There are MAXLEN extra spaces ('A') after the current sliding window
+			for spillover of these additionally read chars.
 			
 		d                                 e
-		+=================================+=================================+===+===+
-		|      former sliding window      |      current sliding window     | A | B |
-		+=================================+=================================+===+===+
+		+=================================+=================================+=======+
+		|      former sliding window      |      current sliding window     |   A   |
+		+=================================+=================================+=======+
 		
-		|-------- sliding_window ---------|-------- sliding_window ---------|-1-|-1-|
+		|-------- sliding_window ---------|-------- sliding_window ---------|MAXLEN-|
 
 The two regions can be represented by pointers 'd' and 'e'. The 'e' window is current, and the 'd' window is former.
-'sliding_window' + 2 bytes of data are initially read into 'e'. Each char of the current sliding window is copied to its
-	relative position in the former sliding window after it is processed. When the current sliding window is fully processed,
-	'A' and 'B' are copied into the first two bytes of 'e', and then the next 'sliding_window' bytes are copied in,
-	filling up the remaining window and the two spillover bytes once again. At this point, the result is that
-	the entire region, from d to B, is a contiguous segment of the source file.
+'sliding_window' + MAXLEN bytes of data are initially read into 'e'. When the current sliding window is fully processed,
+	it and 'A' are moved down by 'sliding_window' in one go, so that the current sliding window becomes the former one and 'A'
+	is at the beginning of 'e', and then the next 'sliding_window' bytes are read in after it, filling up the remaining window
+	and the spillover once again. At all times, the entire region, from d to the end of A, is a contiguous segment of the
+	source file.
 
-The hash table, 'dup_ht', has DUP_HT_SZ struct dup_hash_entry elements, which are each heads of hash chains.
-	Each contains 'ptr', an index into 'dup_entries', and 'len', the length of the hash chain.
+Every char of the input has an absolute position, counting up from 'sliding_window' at the first char; 'pos' is that of e[0].
+	The char at absolute position p is thus at e + p - 'pos', so long as it has not slid out of the former sliding window.
+	A preset dictionary goes right before the first char, at the end of the former sliding window (see deflate_compr_dict).
 
-'dup_entries' is a space of 'sliding_window' shorts; each is an index again into 'dup_entries', thus forming a hash chain.
-	There is no special value for the end of the chain since this cannot be updated to the previous entry in the chain
-		indefinitely without making it doubly linked, so the chain stops according to the 'len' field of the 'dup_ht' entry.
-
-The hash table is updated with each char in the current sliding window read. Only the most recent 'sliding_window'
-	chars are kept; the newest char overwrites the oldest char's spot in 'dup_entries'.
-	The hash at the old char is calculated in order to decrement its hash chain 'len' by 1 (effectively trimming it off).
-	The hash at the new char is calculated in order to increment its hash chain 'len' by 1 and also prepend that dup entry to
-		the hash chain. This ensures every char being replaced is the last entry in its hash chain and can thus be trimmed easily.
+The hash table, 'head', has DUP_HT_SZ elements, which are each the absolute position of the latest char with that hash, and
+	so the head of a hash chain. 'prev' has 'sliding_window' elements: the absolute position of the char before it in its
+	hash chain, indexed by absolute position modulo 'sliding_window'. Inserting a char into its hash chain is thus one hash
+	and two stores.
+	Nothing is ever removed from a hash chain: a char that has slid out is recognised by its distance from the current char
+		being 'sliding_window' or more, which ends the chain (its element of 'prev' may have been overwritten by then). 0 is
+		the position of an empty hash chain, since it is always that far away.
+	How much of a hash chain is actually searched is up to the compression level (see struct deflate_level).
 
 The hash function operates on the current and subsequent two chars. When searching through possible dup strings, simply
-	call check_dup_str on the current char* and the char* obtained by
-		- adding the index of the element in the hash chain to e, if the dup entry came from the current sliding window
-			(its index is less than the current char's index)
-		- subtracting the index of the element in the hash chain from d + the current char's index, if the dup entry
-			came from the former sliding window (its index is greater than or equal to the current char's index).
-	The maximum dup length is 258; if the current string manages to successfully match a dup string up to the end of the sliding
-		window but has not reached 258 chars in length, 258 bytes from the next sliding window are read in ahead to continue
-		checking. The boolean 'read_ahead' is set to indicate this, so that the next 'sliding_window' read-in can start ahead by
-		those 258 bytes.
+	call check_dup_str on the current char* and the char* that is the distance to the element of the hash chain before it.
+	The maximum dup length is 258, so the spillover always holds the rest of a dup string that runs past the current sliding
+		window. The chars of such a dup string past the end of the window belong to the next window, so their hash table
+		updates are carried over and done once it has been read in.
+
+Output:
+	Each literal and len/dist pair is buffered in 'toks' rather than written immediately, since the Huffman codes of a block
+		depend on the symbol frequencies of the whole block. A block ends where the input changes enough that its latest symbols,
+		back to one of the last few points at which it could end, would take fewer bits as a block of their own than added to
+		it, going by a cost model of the symbols of the current block (see deflate_block_split and struct deflate_cost_model),
+		or once DEFLATE_BLOCK_TOKS symbols are buffered, or the input ends. With DEFLATE_DP_SPLIT, DEFLATE_DP_TOKS symbols are
+		buffered instead, and the blocks end wherever they take the fewest bits in all (see deflate_block_plan). A block is
+		written as whichever of a stored (3.2.4), fixed Huffman (3.2.6) or dynamic Huffman block (3.2.7) is the smallest;
+		for a dynamic Huffman block:
+		- the code lengths come from h_tree_builders over the block's frequencies, limited to 15 bits (7 for the code length code)
+		- the canonical codes (3.2.2) are stored bit-reversed in struct deflate_code tables; for lengths, the table is indexed
+			by the length itself and already has the extra bits packed in after the code, so a len/dist pair takes one
+			bit_writer_put
+	The bit writer buffers the output, so 'fd_out' is written to in large batches.
+*/
+
+struct deflate_tok{ // buffered symbol of the current block; same convention as struct compress_stats
+	unsigned short ll; // lit character or length
+	unsigned short d; // 0 or distance
+};
+
+struct deflate_code{ // bit-reversed Huffman code, possibly followed by extra bits
+	unsigned int bits;
+	unsigned int n; // total number of bits
+};
+
+struct deflate_len_sym{ // length to its lit/len code, number of extra bits, and extra bits value (3.2.5)
+	unsigned short sym;
+	unsigned char eb;
+	unsigned char ebits;
+};
+
+struct deflate_level{ // match search tunables of a compression level, in the spirit of zlib's configuration table
+	unsigned short good_len; // while holding back a match at least this long, the hash chain walk is cut to a quarter
+	unsigned short lazy; // take a match at least this long right away instead of trying the next position (0: greedy)
+	unsigned short nice_len; // stop walking the hash chain once a match at least this long is found
+	unsigned short max_chain; // most hash chain entries checked per position
+	unsigned short max_insert; // greedy levels: only the first position of a match longer than this goes into the hash chains (0: all)
+	unsigned short lookahead; // positions a held back match waits for a longer one to turn up: 1, or 2 to also try the one after
+};
+
+/* Levels 1-3 are greedy; 1 and 2 leave the inside of long matches out of the hash chains, as zlib's fastest levels do, so
+	that the few entries they check reach past runs to where the data last repeated (rows of an image, say).
+	Level 8 already finds the longest match within the sliding window nearly everywhere, so level 9 looks two positions
+	ahead rather than further back.
+*/
+static const struct deflate_level DEFLATE_LEVELS[DEFLATE_MAX_LEVEL + 1] = {
+	[1] = {4,  0,     8,    4, 16, 1},
+	[2] = {4,  0,    16,    8, 16, 1},
+	[3] = {4,  0,    32,   16,  0, 1},
+	[4] = {4,  4,    32,   32,  0, 1},
+	[5] = {8,  16,   32,   32,  0, 1},
+	[6] = {8,  16,  128,  128,  0, 1},
+	[7] = {8,  32,  128,  256,  0, 1},
+	[8] = {32, 128, 258, 1024,  0, 1},
+	[9] = {32, 258, 258, 4096,  0, 2}
+};
+
+// Order in which the code length code lengths are written (3.2.7)
+static const unsigned char CL_ORDER[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+static const unsigned char CL_EB[3] = {2, 3, 7}; // extra bits of code length codes 16, 17, 18
+
+// Distances checked by the rle strategy: every size in bytes a whole PNG pixel can have (1 to 4 samples of 8 or 16 bits)
+static const unsigned char RLE_DISTS[] = {1, 2, 3, 4, 6, 8};
+
+// Tables filled in once by deflate_tables_init
+static struct deflate_len_sym len_sym[MAXLEN + 1];
+static unsigned char dist_sym[512]; // indexed through DIST_SYM
+static unsigned short dist_base[NUM_DIST_CODES];
+static unsigned char dist_eb[NUM_DIST_CODES];
+static unsigned char fixed_ll_lens[NUM_FIXED_LITLEN_CODES]; // code lengths of the fixed Huffman codes (3.2.6)
+static unsigned char fixed_d_lens[NUM_DIST_CODES];
+
+struct dup_cand{ // dup string found by find_dups
+	unsigned short len;
+	unsigned short dist;
+};
+
+struct opt_costs{ // expected number of bits of each symbol, extra bits included
+	unsigned int lit[256];
+	unsigned int len[MAXLEN + 1]; // indexed by length
+	unsigned int dist[NUM_DIST_CODES]; // indexed by dist code
+};
+
+struct deflate_opt{ // scratch space of the optimal strategy (see parse_optimal), sized by the sliding window
+	struct dup_cand* cands; // dup strings found at each position of the sliding window
+	int* cand_idx; // where the dup strings of each position start in 'cands'
+	int n_cands; // number of dup strings in 'cands'
+	int cands_cap; // capacity of 'cands'
+	unsigned int* cost; // fewest bits found so far to get to each position
+	struct deflate_tok* step; // the literal or len/dist pair ending that cheapest path to each position
+	struct deflate_tok* path, * best; // a parse of the sliding window, and the cheapest one so far
+};
+
+/* How the symbols of the current block are priced, to decide where it ends (see deflate_block_split)
+	DEFLATE_COST_AHT goes by the ahts, whose depths are the exact Huffman code of the symbols so far, and prices the trees
+		by building the code length code over them; but each insert walks and rebalances the tree. DEFLATE_COST_HIST goes by
+		histograms, whose entropy is an O(1) lower bound on the same (see hist.h), with the trees taken at so many bits
+		per symbol that occurs; it is the cost model of every level of the default strategy and of the fast ones, and of the
+		optimal strategy and statistics ('fd_stats') too with DEFLATE_HIST or DEFLATE_DP_SPLIT, which prices blocks on its
+		own (see deflate_block_plan). DEFLATE_AHT asks for the ahts anyway, which may end blocks a little better.
+		The optimal strategy keeps the ahts either way, for the costs of its first parse.
 */
+struct deflate_cost_model{
+	void (*reset)(deflate_compr_t* com); // empty the model, but for the end of block code
+	void (*insert)(deflate_compr_t* com, int ls, int ds); // add lit/len symbol 'ls' and dist symbol 'ds' (-1 for a literal)
+	unsigned int (*bits)(deflate_compr_t* com); // number of bits of the block, trees included, short of the extra bits
+	unsigned int (*run_bits)(deflate_compr_t* com, const struct hist* ll, const struct hist* d, unsigned int extra); // number of
+		// bits of a block of just the symbols in the histograms 'll' and 'd', the end of block code included, whose extra bits
+		// are 'extra', header and extra bits included
+};
+static const struct deflate_cost_model DEFLATE_COST_AHT, DEFLATE_COST_HIST; // defined with their functions
 
-struct dup_hash_entry{
-	swi ptr; // index to this hash chain head in dup_entries
-	swi len; // length of this hash chain
+struct deflate_seg{ // DEFLATE_SPLIT_STEP symbols of the current block between points at which it may end, or fewer for the latest
+	int start; // index in 'toks' of the first
+	unsigned int bits; // number of bits of the block before it, going by the cost model, extra bits included
+	unsigned int extra; // number of extra bits of the symbols of the block before it
+	size_t bytes; // number of chars they cover
+	struct hist ll, d; // lit/len and dist histograms of its own symbols
 };
 
 struct deflate_compr{ // typedef in include/deflate_ext.h
-	struct aht ll_aht, d_aht; // lit/len and dist ahts
+	struct aht ll_aht, d_aht; // lit/len and dist ahts of the current block
+	struct hist ll_hist, d_hist; // lit/len and dist histograms of the current block, for DEFLATE_COST_HIST
+	struct hist ll_run, d_run; // and of the symbols last weighed on their own (see deflate_block_split)
+	const struct deflate_cost_model* cost; // how the current block is priced (see deflate_block_split)
+	unsigned char ahts_too; // bool, the ahts are kept although they are not the cost model, for the optimal strategy's costs or statistics
+	const struct deflate_level* lvl; // match search tunables
+	int level; // compression level
+	int strategy; // how the input is parsed into literals and len/dist pairs
+	int ops; // DEFLATE_BT selects the binary tree match finder; DEFLATE_HIST and DEFLATE_AHT the cost model; DEFLATE_DP_SPLIT the block planner
+	struct deflate_opt opt; // DEFLATE_OPTIMAL only
+	struct bit_writer bw; // compressed output
+	struct h_tree_builder ll_htb, d_htb, cl_htb; // lit/len, dist, and code length code builders for the block being written
+	struct deflate_tok* toks; // symbols of the current block
+	int n_toks; // number of symbols in 'toks'
+	size_t blk_pos; // absolute position of the first char of the current block
+	struct deflate_seg* segs; // the latest segments of the current block, in order (see deflate_block_split), or all of them with DEFLATE_DP_SPLIT
+	int n_segs; // number of them; the last one is still filling up
+	int segs_cap; // number of them there is room for
+	size_t* plan_bits; // DEFLATE_DP_SPLIT only: fewest bits the blocks up to each segment take (see deflate_block_plan)
+	int* plan_from; // DEFLATE_DP_SPLIT only: first segment of the last of those blocks
+	unsigned char* raw; // DEFLATE_DP_SPLIT only: copy of the chars the buffered symbols cover, for stored blocks, long since slid out
+	size_t raw_pos, raw_len, raw_cap; // absolute position of the first of them, number of them, and room for them
+	unsigned int blk_extra; // number of extra bits of the symbols of the current block
+	size_t blk_bytes; // number of chars they cover
+	unsigned int adler; // adler32 checksum of the input so far
+	unsigned int dictid; // adler32 checksum of the preset dictionary, if any
+	size_t dict_len; // number of chars of the preset dictionary in the former sliding window (0 if none)
 	unsigned char* d, *e; // pointers to former and current sliding windows (see above)
-	struct dup_hash_entry* dup_ht; // an array of heads of hash chains for searching for dup entries
-	swi* dup_entries; // an array of sliding window size containing the hash chains
+	size_t* head; // the latest absolute position with each hash: the head of its hash chain or the root of its binary tree
+	size_t* prev; // hash chains: the absolute position before each one with the same hash (see above)
+	size_t* bt_son; // binary trees: left and right children of each node, indexed by position modulo the sliding window
+	size_t bt_next; // binary trees: next position to be inserted
+	size_t pos; // absolute position of e[0], starting at 'sliding_window'
 	unsigned char* bound; // the bound for bytes read in
 	int fd_in; // where to read uncompressed bytes from
+	const unsigned char* src; // where to read them from instead, if not NULL (see fetch)
+	size_t src_len; // number of bytes left at 'src'
 	int fd_out; // where to write compressed bytes to
 	int fd_stats; // where to write statistics to
 	swi sliding_window; // sliding window size
-	unsigned char read_ahead; // bool (see above)
-	unsigned char done; // bool, finished compressing
+	unsigned char done; // bool, reached the end of the input
+	unsigned char last; // bool, the end of the input is the end of the stream; else it ends with a sync flush (see deflate_compress_parallel)
+	unsigned char wait; // bool, running out of 'src' only means waiting for more of it (see fetch)
+	unsigned char more; // bool, more input follows the end of the input so far, past a sync flush (see bt_find)
+	unsigned char in_place; // bool, 'e' points into 'src' itself rather than 'd' (see deflate_compress_buffer)
+	unsigned char stage; // how far process_loop has got (PL_BEGIN and so on)
+	unsigned char started; // bool, deflate_compr_push has written the zlib header
+	swi fill; // number of chars read in so far by a fetch that is waiting for more
+	int i, held, prev_len, prev_dist; // where process_loop left off while waiting for more input (see process_loop)
+	struct compress_stats cs; // statistics written to 'fd_stats' (see emit)
+	int stats_due; // number of symbols before the tree bits of 'cs' are counted anew (see emit)
+	size_t out; // number of bytes of the output buffer of 'bw' copied out by deflate_compr_push
 };
 
 SPAWNABLE(deflate_compr_t);
 
-void deflate_compr_init(deflate_compr_t* com, int fd_in, int fd_out, int fd_stats, swi sliding_window_sz){
-	if (!(com->d = malloc(com->sliding_window * 2 + 2))){
+static int get_len_code(int x, int* peb, int* pebits);
+static int get_dist_code(int x, int* peb, int* pebits);
+
+// Fill in the length and distance symbol tables from get_len_code and get_dist_code
+static void deflate_tables_init(){
+	static int done = 0;
+	int x, c, eb, ebits;
+	if (done)
+		return;
+	for (x = 3; x <= MAXLEN; x++){
+		len_sym[x].sym = get_len_code(x, &eb, &ebits);
+		len_sym[x].eb = eb;
+		len_sym[x].ebits = ebits;
+	}
+	for (x = 1; x <= 1 << 15; x++){
+		c = get_dist_code(x, &eb, NULL);
+		if (x <= 256 || !((x - 1) & 127)){ // beyond 256, every code spans whole multiples of 128
+			dist_sym[(x <= 256)? x - 1 : 256 + ((x - 1) >> 7)] = c;
+		}
+		if (!dist_base[c]){ // first distance with this code
+			dist_base[c] = x;
+			dist_eb[c] = eb;
+		}
+	}
+	for (x = 0; x < NUM_FIXED_LITLEN_CODES; x++){
+		fixed_ll_lens[x] = (x < 144)? 8 : (x < 256)? 9 : (x < 280)? 7 : 8;
+	}
+	memset(fixed_d_lens, 5, NUM_DIST_CODES);
+	done = 1;
+}
+
+// Fail out unless input can be compressed with a sliding window of size 'sw' at level 'level' with strategy 'strategy'
+static void deflate_params_check(swi sw, int level, int strategy){
+	if (sw < 256 || sw > 1 << 15 || (sw & (sw - 1))){
+		fail_out(E_ZSLWIN);
+	}
+	if (level < 1 || level > DEFLATE_MAX_LEVEL || strategy < 0 || strategy > DEFLATE_HUFFMAN_ONLY){
+		fail_out(E_RANGE);
+	}
+}
+
+// Set up the zeroed 'com' for deflate_compr_init, failing out on an error; with 'dst', the output goes to the 'cap' bytes there
+static void deflate_compr_setup(deflate_compr_t* com, int fd_in, int fd_out, int fd_stats, swi sliding_window_sz, int level, int strategy, int ops,
+	unsigned char* dst, size_t cap){
+	int i;
+	deflate_params_check(sliding_window_sz, level, strategy);
+	deflate_tables_init();
+	com->level = level;
+	com->strategy = strategy;
+	com->ops = (strategy == DEFLATE_DEFAULT || strategy == DEFLATE_OPTIMAL)? ops : ops & ~DEFLATE_BT; // no match finder to pick
+	com->lvl = DEFLATE_LEVELS + level;
+	com->sliding_window = sliding_window_sz;
+	if (!(com->d = malloc(com->sliding_window * 2 + MAXLEN + DUP_STR_SLACK))){
+		fail_out(E_MALLOC);
+	}
+	memset(com->d + com->sliding_window * 2 + MAXLEN, 0, DUP_STR_SLACK);
+	i = (com->ops & DEFLATE_DP_SPLIT)? DEFLATE_DP_TOKS / DEFLATE_SPLIT_STEP : DEFLATE_SPLIT_WINDOW;
+	if (!(com->toks = malloc(((com->ops & DEFLATE_DP_SPLIT)? DEFLATE_DP_TOKS : DEFLATE_BLOCK_TOKS) * sizeof(struct deflate_tok)))
+		|| !(com->segs = calloc(i, sizeof(struct deflate_seg)))){
 		fail_out(E_MALLOC);
 	}
+	com->segs_cap = i;
+	if (com->ops & DEFLATE_DP_SPLIT){
+		com->raw_cap = DEFLATE_DP_BYTES + DEFLATE_SPLIT_STEP * MAXLEN; // may grow (see deflate_tok_add)
+		if (!(com->plan_bits = malloc((com->segs_cap + 1) * sizeof(size_t)))
+			|| !(com->plan_from = malloc((com->segs_cap + 1) * sizeof(int)))
+			|| !(com->raw = malloc(com->raw_cap))){
+			fail_out(E_MALLOC);
+		}
+	}
+	if (dst){
+		bit_writer_init_buf(&com->bw, dst, cap);
+	}
+	else{
+		bit_writer_init(&com->bw, fd_out);
+	}
+	h_tree_builder_init(&com->ll_htb, NUM_LITLEN_CODES);
+	h_tree_builder_init(&com->d_htb, NUM_DIST_CODES);
+	h_tree_builder_init(&com->cl_htb, 19);
 	aht_init(&com->ll_aht, NUM_LITLEN_CODES);
 	aht_init(&com->d_aht, NUM_DIST_CODES);
-	if (!(com->dup_entries = malloc(com->sliding_window * sizeof(swi)))){
-		fail_out(E_MALLOC);
+	hist_init(&com->ll_hist, NUM_LITLEN_CODES);
+	hist_init(&com->d_hist, NUM_DIST_CODES);
+	hist_init(&com->ll_run, NUM_LITLEN_CODES);
+	hist_init(&com->d_run, NUM_DIST_CODES);
+	for (i = 0; i < com->segs_cap; i++){
+		hist_init(&com->segs[i].ll, NUM_LITLEN_CODES);
+		hist_init(&com->segs[i].d, NUM_DIST_CODES);
 	}
-	if (!(com->dup_ht = calloc(DUP_HT_SZ, sizeof(struct dup_hash_entry)))){
+	if (!(com->head = calloc(DUP_HT_SZ, sizeof(size_t)))){
 		fail_out(E_MALLOC);
 	}
+	if (com->ops & DEFLATE_BT){
+		if (!(com->bt_son = calloc(com->sliding_window * 2, sizeof(size_t)))){
+			fail_out(E_MALLOC);
+		}
+	}
+	else{
+		if (!(com->prev = malloc(com->sliding_window * sizeof(size_t)))){
+			fail_out(E_MALLOC);
+		}
+	}
+	com->pos = com->bt_next = com->sliding_window;
+	if (strategy == DEFLATE_OPTIMAL){
+		com->opt.cands_cap = com->sliding_window * 2;
+		if (!(com->opt.cands = malloc(com->opt.cands_cap * sizeof(struct dup_cand)))
+			|| !(com->opt.cand_idx = malloc((com->sliding_window + 1) * sizeof(int)))
+			|| !(com->opt.cost = malloc((com->sliding_window + 1) * sizeof(unsigned int)))
+			|| !(com->opt.step = malloc((com->sliding_window + 1) * sizeof(struct deflate_tok)))
+			|| !(com->opt.path = malloc(com->sliding_window * sizeof(struct deflate_tok)))
+			|| !(com->opt.best = malloc(com->sliding_window * sizeof(struct deflate_tok)))){
+			fail_out(E_MALLOC);
+		}
+	}
 	com->fd_in = fd_in;
+	com->src = NULL;
+	com->src_len = 0;
 	com->fd_out = fd_out;
 	com->fd_stats = fd_stats;
-	com->sliding_window = sliding_window_sz;
+	com->cost = (!(ops & (DEFLATE_HIST | DEFLATE_DP_SPLIT)) && ((ops & DEFLATE_AHT) || strategy == DEFLATE_OPTIMAL || fd_stats >= 0))?
+		&DEFLATE_COST_AHT : &DEFLATE_COST_HIST;
+	com->ahts_too = com->cost != &DEFLATE_COST_AHT && (strategy == DEFLATE_OPTIMAL || fd_stats >= 0);
 	com->e = com->d + com->sliding_window;
-	com->read_ahead = 0;
+	com->n_toks = 0;
+	com->blk_pos = com->raw_pos = com->sliding_window;
+	com->raw_len = 0;
+	com->n_segs = 0;
+	com->blk_extra = 0;
+	com->blk_bytes = 0;
+	com->adler = 1;
+	com->dictid = 0;
+	com->dict_len = 0;
 	com->done = 0;
+	com->last = 1;
+	com->wait = 0;
+	com->in_place = 0;
+	com->stage = PL_BEGIN;
+	com->started = 0;
+	com->fill = 0;
+	com->i = com->held = com->prev_dist = 0;
+	com->prev_len = 2;
+	com->cs.bytes = 1;
+	com->stats_due = 0;
+	com->out = 0;
+}
+
+/* Initialize 'com' to compress from 'fd_in' to 'fd_out' (-1 for both with deflate_compr_push) as deflate_compress does
+	Returns 0, or E_ZSLWIN or E_RANGE for parameters out of range, or E_MALLOC; after an error nothing is left allocated, and
+		'com' is not to be deinitialized.
+*/
+int deflate_compr_init(deflate_compr_t* com, int fd_in, int fd_out, int fd_stats, swi sliding_window_sz, int level, int strategy, int ops){
+	int ret;
+	memset(com, 0, sizeof(*com)); // all NULL, so that deflate_compr_deinit frees just what was allocated before a failure
+	if (!(ret = fail_checkpoint())){
+		deflate_compr_setup(com, fd_in, fd_out, fd_stats, sliding_window_sz, level, strategy, ops, NULL, 0);
+	}
+	fail_uncheckpoint();
+	if (ret){
+		deflate_compr_deinit(com);
+	}
+	return ret;
+}
+
+/* Prime 'com' with the preset dictionary 'dict' of length 'len' (rfc1950 2.2, FDICT), before anything is compressed
+	Its last 'sliding_window' chars are placed right before the current sliding window, as if they were the input just before
+		it, so dup strings may reach back into them. They are inserted into the hash chains (or binary trees) once the first
+		chars of the input are read in (see process_loop).
+*/
+void deflate_compr_dict(deflate_compr_t* com, const unsigned char* dict, size_t len){
+	com->dictid = adler32_update(1, dict, len);
+	com->dict_len = min(len, com->sliding_window);
+	memcpy(com->e - com->dict_len, dict + len - com->dict_len, com->dict_len);
+	com->bt_next = com->pos - com->dict_len;
 }
 
 void deflate_compr_deinit(deflate_compr_t* com){
+	int i;
 	free(com->d);
+	free(com->toks);
+	bit_writer_deinit(&com->bw);
+	h_tree_builder_deinit(&com->ll_htb);
+	h_tree_builder_deinit(&com->d_htb);
+	h_tree_builder_deinit(&com->cl_htb);
 	free(com->ll_aht.tree);
 	free(com->d_aht.tree);
-	free(com->dup_entries);
-	free(com->dup_ht);
+	free(com->ll_hist.freq);
+	free(com->d_hist.freq);
+	free(com->ll_run.freq);
+	free(com->d_run.freq);
+	for (i = 0; i < com->segs_cap; i++){
+		free(com->segs[i].ll.freq);
+		free(com->segs[i].d.freq);
+	}
+	free(com->segs);
+	free(com->plan_bits);
+	free(com->plan_from);
+	free(com->raw);
+	free(com->head);
+	free(com->prev);
+	free(com->bt_son);
+	free(com->opt.cands);
+	free(com->opt.cand_idx);
+	free(com->opt.cost);
+	free(com->opt.step);
+	free(com->opt.path);
+	free(com->opt.best);
+}
+
+// Take the input from the 'len' bytes at 'src' rather than 'fd_in', searching for dup strings right there if it is long enough
+//	for a whole window past the first MAXLEN chars, and there is no preset dictionary to put before it (see rotate_sliding_window)
+static void deflate_compr_src(deflate_compr_t* com, const unsigned char* src, size_t len){
+	com->src = (len)? src : com->d; // not NULL, which means 'fd_in'
+	com->src_len = len;
+	if (!com->dict_len && len >= MAXLEN + com->sliding_window + DUP_STR_SLACK){
+		com->e = (unsigned char*)src; // only ever read through
+		com->in_place = 1;
+	}
 }
 
-// Hash table uses a hash function based on the first three characters of the dup string
-short dup_hash(const unsigned char* p){
+/* Hash table uses a hash function based on the first three characters of the dup string
+	Defining DUP_HASH_INTERLEAVE selects interleaving the bits of the three chars, which keeps only their low bits.
+	By default, the three chars are instead multiplied by a Fibonacci hashing constant and the top DUP_HT_BITS bits are taken,
+		so that every bit of the three chars has a say in which chain they land in.
+*/
+static inline unsigned int dup_hash(const unsigned char* p){
+#ifdef DUP_HASH_INTERLEAVE
 	// Interleave bits of p[0], p[1], and p[2]
 	// Thanks for your code https://stackoverflow.com/a/1024889
 	int x, y, z;
@@ -132,56 +508,93 @@ short dup_hash(const unsigned char* p){
 	z = (z | (z << 4)) & 0x000C30C3;
 	z = (z | (z << 2)) & 0x00249249;
 	return (x | (y << 1) | (z << 2)) % DUP_HT_SZ;
+#else
+	return ((((unsigned int)p[0] << 16) | ((unsigned int)p[1] << 8) | p[2]) * 2654435761U) >> (32 - DUP_HT_BITS);
+#endif
 }
 
-// TODO: figure out bound for reading in and stuff
-
-void fetch(deflate_compr_t* com, unsigned char* p, swi len){
-	int ret = read(com->fd_in, p, len); // TODO: get bytes here
-	com->bound = p + ret;
-	if (!ret){
+// Read up to 'len' bytes into 'p', stopping short (and setting 'done') only at the end of the input; returns 1, or 0 if it has to wait
+//	The input is 'src' if there is one, else 'fd_in'. With 'wait', running out of 'src' leaves 'fill' bytes read in and
+//	returns 0, and the same call picks up from there once there is more of it (see deflate_compr_push)
+int fetch(deflate_compr_t* com, unsigned char* p, swi len){
+	ssize_t ret;
+	unsigned char* q = p + com->fill;
+	if (com->src){
+		ret = min(len - com->fill, com->src_len);
+		if (q != com->src){ // else already in place
+			memcpy(q, com->src, ret);
+		}
+		com->src += ret;
+		com->src_len -= ret;
+		q += ret;
+	}
+	for (; !com->src && q < p + len; q += ret){
+		ret = read(com->fd_in, q, p + len - q);
+		if (ret < 0){
+			fail_out(E_READ);
+		}
+		if (!ret){
+			break;
+		}
+	}
+	com->adler = adler32_update(com->adler, p + com->fill, q - p - com->fill);
+	if (q < p + len && com->wait){
+		com->fill = q - p;
+		return 0;
+	}
+	com->fill = 0;
+	com->bound = q;
+	if (q < p + len){
 		com->done = 1;
 	}
+	return 1;
 }
 
-void fetch_sliding_window(deflate_compr_t* com){
-	if (com->read_ahead){
-		fetch(com, com->e + MAXLEN, com->sliding_window + 2 - MAXLEN);
-	}
-	else{
-		fetch(com, com->e + 2, com->sliding_window);
+// Slide the current sliding window and the spillover down into the former sliding window (see above)
+//	In place, 'e' just moves on through 'src' instead, until the next window and its DUP_STR_SLACK would run past the end of it
+void rotate_sliding_window(deflate_compr_t* com){
+	swi sw = com->sliding_window;
+	com->pos += sw;
+	if (com->in_place && com->src_len >= sw + DUP_STR_SLACK){
+		com->e += sw;
+		return;
 	}
+	memmove(com->d, com->e, sw + MAXLEN);
+	com->bound = com->d + (com->bound - com->e);
+	com->e = com->d + sw;
+	com->in_place = 0;
 }
 
-void fetch_ahead(deflate_compr_t* com){
-	fetch(com, com->e + 2, MAXLEN - 2);
-	com->read_ahead = 1;
-	//com->e[0] = com->e[com->sliding_window];
-	//com->e[1] = com->e[com->sliding_window + 1];
+/* Returns how many chars 'str' and 'dup' have in common from 'i' on, counting from 0 and stopping at 'lim'
+	Compares a word at a time: the lowest set bit of the xor of two words is in the first byte that differs (on a little endian
+		machine; the highest on a big endian one). The last word may run past 'lim', and so past 'bound', by up to
+		DUP_STR_SLACK - 1 bytes, which is what the slack past the spillover is for.
+*/
+static inline int dup_str_len(const unsigned char* str, const unsigned char* dup, int i, int lim){
+	unsigned long long x, y;
+	for (; i < lim; i += sizeof(x)){
+		memcpy(&x, str + i, sizeof(x));
+		memcpy(&y, dup + i, sizeof(y));
+		if ((x ^= y)){
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+			i += __builtin_clzll(x) >> 3;
+#else
+			i += __builtin_ctzll(x) >> 3;
+#endif
+			break;
+		}
+	}
+	return min(i, lim);
 }
 
 // Returns the common subsequence length of the current position 'str' and the duplicate entry 'dup'
 int check_dup_str(deflate_compr_t* com, const unsigned char* str, const unsigned char* dup){
-	int ret = 0;
-	while (str < com->bound && *(str++) == *(dup++)){
-		if (++ret == MAXLEN)// || str > com->bound)
-			break;
-		if (str > com->e + 2 + com->sliding_window){
-			if (!com->read_ahead){
-				fetch_ahead(com);
-				//if (com->done){ // nothing fetched; done
-				//	break;
-				//}
-			}
-			str = com->e + 2;
-		}
-	}
-	return ret;
+	return dup_str_len(str, dup, 0, min(com->bound - str, MAXLEN));
 }
 
-int get_len_code(int x, int* peb, int* pebits){
+static int get_len_code(int x, int* peb, int* pebits){
 	// "Length" to "Code", "Extra Bits", and offset in 3.2.5 Table 1
-	int eb = 0;
+	int eb = 0, ebits = 0;
 	if (x < 11){
 		x += 254;
 	}
@@ -189,188 +602,1807 @@ int get_len_code(int x, int* peb, int* pebits){
 		x = 285;
 	}
 	else{
-		eb = 28 - __builtin_clz(x - 3);
-		if (pebits)
-			*pebits = (x - 3) & ((1 << eb) - 1);
-		x = 261 + eb * 4 + (x - 3) / (1 << (eb + 1));
+		eb = 29 - __builtin_clz(x - 3);
+		ebits = (x - 3) & ((1 << eb) - 1);
+		x = 261 + eb * 4 + (((x - 3) >> eb) & 3);
 	}
 	if (peb)
 		*peb = eb;
+	if (pebits)
+		*pebits = ebits;
 	return x;
 }
 
-int get_dist_code(int x, int* peb, int* pebits){
+static int get_dist_code(int x, int* peb, int* pebits){
 	// "Distance" to "Code", "Extra Bits", and offset in 3.2.5 Table 2
-	int eb = 0;
+	int eb = 1, ebits = 0;
 	if (x < 5){
 		x--;
 	}
 	else{
 		eb = 31 - __builtin_clz(x - 1);
-		if (pebits)
-			*pebits = (x - 1) & ((1 << (eb - 1)) - 1);
+		ebits = (x - 1) & ((1 << (eb - 1)) - 1);
 		x = eb * 2 + (((x - 1) >> (eb - 1)) & 1);
 	}
 	if (peb)
 		*peb = eb - 1;
+	if (pebits)
+		*pebits = ebits;
 	return x;
 }
 
-void process_loop(deflate_compr_t* com, struct h_tree_builder* htb){
-	int i, j, t; // i and j are loop iterators, t is a scratch variable
-	int c; // offset of dup, taken from com->d
-	
-	struct compress_stats cs;
+// Fill 'lens' with the code lengths (at most 'max_len') of a Huffman code for the symbol frequencies 'freq' using 'htb'
+//	A code is always given at least two symbols (unused ones if need be) so that decoders never see a lone 1-bit code
+static void deflate_tree_lens(struct h_tree_builder* htb, const unsigned int* freq, unsigned char* lens, int max_len){
+	int i, n;
+	h_tree_builder_reset(htb);
+	for (i = n = 0; i < htb->cap; i++){
+		htb->q[i].val = i;
+		htb->q[i].weight = freq[i];
+		if (freq[i])
+			n++;
+	}
+	for (i = 0; n < 2; i++){
+		if (!htb->q[i].weight){
+			htb->q[i].weight = 1;
+			n++;
+		}
+	}
+	h_tree_builder_build(htb);
+	h_tree_builder_lens(htb, lens, max_len);
+}
+
+// Fill 'codes' with the bit-reversed canonical Huffman codes (3.2.2) of the 'n' code lengths 'lens'
+static void deflate_codes(const unsigned char* lens, int n, struct deflate_code* codes){
+	unsigned int count[16] = {0}, next[16];
+	int i;
+	for (i = 0; i < n; i++){
+		count[lens[i]]++;
+	}
+	count[0] = 0;
+	for (next[0] = 0, i = 1; i < 16; i++){
+		next[i] = (next[i - 1] + count[i - 1]) << 1;
+	}
+	for (i = 0; i < n; i++){
+		codes[i].n = lens[i];
+		codes[i].bits = (lens[i])? reverse_bits(next[lens[i]]++, lens[i]) : 0;
+	}
+}
+
+// Number of chars the 'n' symbols at 't' cover, and number of extra bits they take
+static void deflate_toks_size(const struct deflate_tok* t, int n, size_t* bytes, unsigned int* extra){
+	*bytes = *extra = 0;
+	for (; n > 0; n--, t++){
+		if (!t->d){
+			(*bytes)++;
+		}
+		else{
+			*bytes += t->ll;
+			*extra += len_sym[t->ll].eb + dist_eb[DIST_SYM(t->d)];
+		}
+	}
+}
+
+struct deflate_dyn{ // dynamic Huffman codes of a run of symbols (3.2.7), and the number of bits of the block they make
+	unsigned int ll_freq[NUM_LITLEN_CODES], d_freq[NUM_DIST_CODES], cl_freq[19];
+	unsigned char ll_lens[NUM_LITLEN_CODES], d_lens[NUM_DIST_CODES], cl_lens[19];
+	unsigned char rle_syms[NUM_LITLEN_CODES + NUM_DIST_CODES], rle_extra[NUM_LITLEN_CODES + NUM_DIST_CODES]; // code lengths, run-length encoded
+	int hlit, hdist, hclen, n_rle;
+	size_t bytes; // number of chars the symbols cover
+	unsigned int extra; // number of extra bits they take
+	size_t bits; // number of bits of the whole block, header included
+};
+
+// Fill in the rest of 'dy' from its lit/len and dist frequencies (the end of block code included) and extra bits
+static void deflate_dyn_codes(deflate_compr_t* com, struct deflate_dyn* dy){
+	unsigned char lens[NUM_LITLEN_CODES + NUM_DIST_CODES]; // lit/len code lengths followed by dist code lengths
+	int i;
+	memset(dy->cl_freq, 0, sizeof(dy->cl_freq));
+	deflate_tree_lens(&com->ll_htb, dy->ll_freq, dy->ll_lens, 15);
+	deflate_tree_lens(&com->d_htb, dy->d_freq, dy->d_lens, 15);
 	
-	struct dup_hash_entry* dh;
-	swi hash;
-	int dup_carry_over; // number of characters wrapping around to the next sliding window, which must be copied separately
+	// code lengths, run-length encoded with the code length code (3.2.7)
+	for (dy->hlit = NUM_LITLEN_CODES; !dy->ll_lens[dy->hlit - 1]; dy->hlit--);
+	for (dy->hdist = NUM_DIST_CODES; !dy->d_lens[dy->hdist - 1]; dy->hdist--);
+	memcpy(lens, dy->ll_lens, dy->hlit);
+	memcpy(lens + dy->hlit, dy->d_lens, dy->hdist);
+	dy->n_rle = h_tree_rle_lens(lens, dy->hlit + dy->hdist, dy->rle_syms, dy->rle_extra);
+	for (i = 0; i < dy->n_rle; i++){
+		dy->cl_freq[dy->rle_syms[i]]++;
+	}
+	deflate_tree_lens(&com->cl_htb, dy->cl_freq, dy->cl_lens, 7);
+	for (dy->hclen = 19; dy->hclen > 4 && !dy->cl_lens[CL_ORDER[dy->hclen - 1]]; dy->hclen--);
 	
-	int max_len; // maximum dup match length found from the hash chain
-	int max_idx; // maximum dup match index found from the hash chain
-	int first_window = 1; // bool to treat com->d as invalid for the first sliding window
+	dy->bits = 17 + 3 * dy->hclen + dy->extra;
+	for (i = 0; i < 19; i++){
+		dy->bits += dy->cl_freq[i] * (dy->cl_lens[i] + ((i >= 16)? CL_EB[i - 16] : 0));
+	}
+	for (i = 0; i < NUM_LITLEN_CODES; i++){
+		dy->bits += dy->ll_freq[i] * dy->ll_lens[i];
+	}
+	for (i = 0; i < NUM_DIST_CODES; i++){
+		dy->bits += dy->d_freq[i] * dy->d_lens[i];
+	}
+}
+
+// Fill in 'dy' for the 'n' symbols at 'toks'
+static void deflate_dyn_plan(deflate_compr_t* com, const struct deflate_tok* toks, int n, struct deflate_dyn* dy){
+	const struct deflate_tok* t;
+	memset(dy->ll_freq, 0, sizeof(dy->ll_freq));
+	memset(dy->d_freq, 0, sizeof(dy->d_freq));
+	for (t = toks; t < toks + n; t++){
+		if (!t->d){
+			dy->ll_freq[t->ll]++;
+		}
+		else{
+			dy->ll_freq[len_sym[t->ll].sym]++;
+			dy->d_freq[DIST_SYM(t->d)]++;
+		}
+	}
+	dy->ll_freq[256] = 1; // end of block
+	deflate_toks_size(toks, n, &dy->bytes, &dy->extra);
+	deflate_dyn_codes(com, dy);
+}
+
+// Write the 'len' chars at 'p' as stored blocks (3.2.4), the last of them marked as the final block if 'last'
+static void deflate_stored_write(deflate_compr_t* com, const unsigned char* p, size_t len, int last){
+	unsigned long long x;
+	size_t n;
+	do{
+		n = min(len, 0xffff);
+		len -= n;
+		bit_writer_put(&com->bw, (last && !len)? 1 : 0, 3); // BFINAL, BTYPE = 00
+		bit_writer_align(&com->bw);
+		bit_writer_put(&com->bw, n | (~n & 0xffff) << 16, 32); // LEN, NLEN
+		for (; n >= sizeof(x); n -= sizeof(x), p += sizeof(x)){
+			memcpy(&x, p, sizeof(x)); // little endian, like bit_writer_word
+			bit_writer_put(&com->bw, x, 64);
+		}
+		for (; n > 0; n--){
+			bit_writer_put(&com->bw, *p++, 8);
+		}
+	} while (len);
+}
+
+// Number of bits of a fixed Huffman block (3.2.6) of symbols with the lit/len and dist frequencies 'll_freq' and 'd_freq'
+//	(the end of block code included) whose extra bits are 'extra'
+static size_t deflate_fixed_bits(const unsigned int* ll_freq, const unsigned int* d_freq, unsigned int extra){
+	size_t bits = 3 + extra;
+	int i;
+	for (i = 0; i < NUM_LITLEN_CODES; i++){
+		bits += ll_freq[i] * fixed_ll_lens[i];
+	}
+	for (i = 0; i < NUM_DIST_CODES; i++){
+		bits += d_freq[i] * fixed_d_lens[i];
+	}
+	return bits;
+}
+
+// Number of bits of the stored blocks (3.2.4) of 'len' chars, the first of which is aligned with 'pad' bits after its 3
+static size_t deflate_stored_bits(size_t len, int pad){
+	size_t bits = 3 + pad + 32 + 8 * len, k;
+	for (k = 0xffff; k < len; k += 0xffff){
+		bits += 8 + 32;
+	}
+	return bits;
+}
+
+/* Write the 'n' symbols at 'toks', the first buffered ones of the current block, as a block, marked as the final block if
+	'last', and move the start of the block past them
+	The block is written in whichever encoding takes the fewest bits, counted exactly: stored, if its chars are still in the
+		sliding window or copied in 'raw', fixed Huffman codes, or dynamic Huffman codes.
+*/
+static void deflate_block_out(deflate_compr_t* com, const struct deflate_tok* toks, int n, int last){
+	struct deflate_dyn dy;
+	struct deflate_code ll_codes[NUM_FIXED_LITLEN_CODES], d_codes[NUM_DIST_CODES], cl_codes[19];
+	struct deflate_code len_codes[MAXLEN + 1]; // lit/len code with the extra bits packed in, indexed by length
+	struct deflate_code* lc, * dc;
+	const struct deflate_tok* t;
+	int i, s;
+	size_t fixed_bits, stored_bits;
 	
-	// insert end of block token (256) into ll_aht immediately, since it will always be there once
-	aht_insert(&com->ll_aht, 256);
-	cs.bytes = 1;
+	deflate_dyn_plan(com, toks, n, &dy);
+	fixed_bits = deflate_fixed_bits(dy.ll_freq, dy.d_freq, dy.extra);
+	stored_bits = ~(size_t)0;
+	if (com->raw || com->blk_pos + com->sliding_window >= com->pos){ // its chars have not slid out yet, or are copied
+		stored_bits = deflate_stored_bits(dy.bytes, (8 - (com->bw.n + 3) % 8) % 8);
+	}
 	
-	fetch(com, com->e, 2);
-	for (i = 0;;){
-		fetch_sliding_window(com); // read next sliding window into 'e' + 2
-		if (com->done) // finished
-			break;
-		com->read_ahead = 0;
-		for (; i < com->bound - com->e;){ // for each character in sliding window
-			hash = dup_hash(com->e + i);
-			dh = com->dup_ht + hash;
-			hash = dh->ptr; // hash now maintains the hash chain element index
-			max_len = 2; // need at least 3 to make len/dist worth it
-			max_idx = -1;
-			for (j = 0; j < dh->len; j++){ // loop through hash chain
-				if (hash < i){ // element is within this sliding window
-					c = hash + com->sliding_window;
-				}
-				else{ // element is within previous sliding window
-					c = hash;
-				}
-				// check for dup string and save if it's the longest
-				t = check_dup_str(com, com->e + i, com->d + c);
-				if (t > max_len){
-					max_len = t;
-					max_idx = c;
+	if (stored_bits <= dy.bits && stored_bits <= fixed_bits){
+		deflate_stored_write(com, (com->raw)? com->raw + (com->blk_pos - com->raw_pos) : com->e + (com->blk_pos - com->pos), dy.bytes, last);
+	}
+	else{
+		if (fixed_bits <= dy.bits){
+			deflate_codes(fixed_ll_lens, NUM_FIXED_LITLEN_CODES, ll_codes);
+			deflate_codes(fixed_d_lens, NUM_DIST_CODES, d_codes);
+			bit_writer_put(&com->bw, (last? 1 : 0) | (1 << 1), 3);
+		}
+		else{
+			deflate_codes(dy.ll_lens, NUM_LITLEN_CODES, ll_codes);
+			deflate_codes(dy.d_lens, NUM_DIST_CODES, d_codes);
+			deflate_codes(dy.cl_lens, 19, cl_codes);
+			bit_writer_put(&com->bw, (last? 1 : 0) | (2 << 1) | ((dy.hlit - 257) << 3) | ((dy.hdist - 1) << 8) | ((dy.hclen - 4) << 13), 17);
+			for (i = 0; i < dy.hclen; i++){
+				bit_writer_put(&com->bw, dy.cl_lens[CL_ORDER[i]], 3);
+			}
+			for (i = 0; i < dy.n_rle; i++){
+				s = dy.rle_syms[i];
+				bit_writer_put(&com->bw, cl_codes[s].bits, cl_codes[s].n);
+				if (s >= 16){
+					bit_writer_put(&com->bw, dy.rle_extra[i], CL_EB[s - 16]);
 				}
-				hash = com->dup_entries[hash]; // proceed to next hash element
 			}
-			
-			dup_carry_over = 0;
-			if (max_len < 3){
-				j = i + 1;
-				//dprintf(com->fd_out, "%c", com->e[i]);
-				// TODO: write lit
-				aht_insert(&com->ll_aht, com->e[i]);
-				max_len = 1;
+		}
+		for (i = 3; i <= MAXLEN; i++){
+			lc = ll_codes + len_sym[i].sym;
+			len_codes[i].bits = lc->bits | ((unsigned int)len_sym[i].ebits << lc->n);
+			len_codes[i].n = lc->n + len_sym[i].eb;
+		}
+		
+		// data
+		for (t = toks; t < toks + n; t++){
+			if (!t->d){
+				bit_writer_put(&com->bw, ll_codes[t->ll].bits, ll_codes[t->ll].n);
 			}
 			else{
-				max_idx = com->e + i - (com->d + max_idx); // now distance
-				//dprintf(com->fd_out, "Len: %d, dist: %d\n", max_len, max_idx);
-				
-				aht_insert(&com->ll_aht, get_len_code(max_len, NULL, NULL));
-				aht_insert(&com->d_aht, get_dist_code(max_idx, NULL, NULL));
-				// TODO: write len/dist pair
-				
-				if (i + max_len > com->sliding_window){ // prevent overflow
-					dup_carry_over = i + max_len - com->sliding_window;
-					j = com->sliding_window; // copy from i up to sliding_window, then copy from com->e up to dup_carry_over
-				}
-				else{
-					j = i + max_len;
-				}
+				lc = len_codes + t->ll;
+				s = DIST_SYM(t->d);
+				dc = d_codes + s;
+				bit_writer_put(&com->bw, lc->bits
+					| ((unsigned long long)dc->bits << lc->n)
+					| ((unsigned long long)(t->d - dist_base[s]) << (lc->n + dc->n)),
+					lc->n + dc->n + dist_eb[s]);
 			}
-			
-			h_tree_builder_reset(htb);
-			if (com->fd_stats >= 0)
-				cs.tree_bits = h_tree_d_lens(htb->q, &com->ll_aht, &com->d_aht, NULL);
-			h_tree_builder_build(htb);
-			if (com->fd_stats >= 0){
-				cs.tree_bits += h_tree_builder_score(htb);
-				
-				cs.ll_bits = com->ll_aht.score;
-				cs.d_bits = com->d_aht.score;
-				
-				if (max_len < 3){ // lit
-					cs.ll = com->e[i]; // lit character
-					cs.d = 0; // 0 to indicate this is a literal
-				}
-				else{ // len/dist pair
-					cs.ll = max_len; // len
-					cs.d = max_idx; // dist
-				}
-				write(com->fd_stats, &cs, sizeof(cs));
+		}
+		bit_writer_put(&com->bw, ll_codes[256].bits, ll_codes[256].n);
+	}
+	com->blk_pos += dy.bytes;
+}
+
+// Write the first 'n' buffered symbols of 'com' as a block, marked as the final block if 'last', and start the next block
+//	with the rest of them (see deflate_block_out and deflate_block_reset)
+static void deflate_block_reset(deflate_compr_t* com, int n);
+static void deflate_block_write(deflate_compr_t* com, int n, int last){
+	deflate_block_out(com, com->toks, n, last);
+	memmove(com->toks, com->toks + n, (com->n_toks - n) * sizeof(struct deflate_tok));
+	com->n_toks -= n;
+	deflate_block_reset(com, n);
+}
+
+// Empty the ahts, but for the end of block code, which every block has once
+static void deflate_aht_reset(deflate_compr_t* com){
+	aht_reset(&com->ll_aht);
+	aht_reset(&com->d_aht);
+	aht_insert(&com->ll_aht, 256);
+}
+
+// Add lit/len symbol 'ls' and dist symbol 'ds' (-1 for a literal) to the ahts
+static void deflate_aht_insert(deflate_compr_t* com, int ls, int ds){
+	aht_insert(&com->ll_aht, ls);
+	if (ds >= 0){
+		aht_insert(&com->d_aht, ds);
+	}
+}
+
+// Number of bits of the block going by the ahts: the dynamic Huffman trees (see h_tree_d_lens) and the symbols
+static unsigned int deflate_aht_bits(deflate_compr_t* com){
+	unsigned int bits;
+	h_tree_builder_reset(&com->cl_htb);
+	bits = h_tree_d_lens(com->cl_htb.q, &com->ll_aht, &com->d_aht, NULL);
+	h_tree_builder_build(&com->cl_htb);
+	return bits + h_tree_builder_score(&com->cl_htb) + com->ll_aht.score + com->d_aht.score;
+}
+
+// Exactly, through the dynamic Huffman codes of the symbols (see deflate_dyn_codes)
+static unsigned int deflate_aht_run_bits(deflate_compr_t* com, const struct hist* ll, const struct hist* d, unsigned int extra){
+	struct deflate_dyn dy;
+	memcpy(dy.ll_freq, ll->freq, sizeof(dy.ll_freq));
+	memcpy(dy.d_freq, d->freq, sizeof(dy.d_freq));
+	dy.extra = extra;
+	deflate_dyn_codes(com, &dy);
+	return dy.bits;
+}
+
+// As deflate_aht_reset, for the histograms
+static void deflate_hist_reset(deflate_compr_t* com){
+	hist_reset(&com->ll_hist);
+	hist_reset(&com->d_hist);
+	hist_insert(&com->ll_hist, 256);
+}
+
+// As deflate_aht_insert, for the histograms
+static void deflate_hist_insert(deflate_compr_t* com, int ls, int ds){
+	hist_insert(&com->ll_hist, ls);
+	if (ds >= 0){
+		hist_insert(&com->d_hist, ds);
+	}
+}
+
+// Number of bits of a block with the symbols in the histograms 'll' and 'd': the symbols at their entropy, and the trees at
+//	DEFLATE_HIST_TREE_BITS plus DEFLATE_HIST_LEN_BITS per symbol that occurs
+static unsigned int hist_block_bits(const struct hist* ll, const struct hist* d){
+	return hist_bits(ll) + hist_bits(d) + DEFLATE_HIST_TREE_BITS + DEFLATE_HIST_LEN_BITS * (ll->used + d->used);
+}
+
+// As deflate_aht_bits, for the histograms
+static unsigned int deflate_hist_bits(deflate_compr_t* com){
+	return hist_block_bits(&com->ll_hist, &com->d_hist);
+}
+
+// By the same measure as deflate_hist_bits
+static unsigned int deflate_hist_run_bits(deflate_compr_t* com, const struct hist* ll, const struct hist* d, unsigned int extra){
+	return 3 + hist_block_bits(ll, d) + extra;
+}
+
+static const struct deflate_cost_model DEFLATE_COST_AHT = {deflate_aht_reset, deflate_aht_insert, deflate_aht_bits, deflate_aht_run_bits};
+static const struct deflate_cost_model DEFLATE_COST_HIST = {deflate_hist_reset, deflate_hist_insert, deflate_hist_bits, deflate_hist_run_bits};
+
+// Add a literal ('d' == 0) or len/dist pair to the cost model of the current block, and to the ahts if they are kept besides
+static inline void deflate_cost_add(deflate_compr_t* com, int ll, int d){
+	int ls = (d)? len_sym[ll].sym : ll, ds = (d)? DIST_SYM(d) : -1;
+	com->cost->insert(com, ls, ds);
+	if (com->ahts_too){
+		deflate_aht_insert(com, ls, ds);
+	}
+	if (d){
+		com->blk_extra += len_sym[ll].eb + dist_eb[ds];
+	}
+	com->blk_bytes += (d)? ll : 1;
+}
+
+// Start a new segment of the current block at the end of the buffer (see deflate_block_split), the bits of the block so far
+//	being 'bits'; the oldest one makes way for it if there is no room
+static void deflate_seg_open(deflate_compr_t* com, unsigned int bits){
+	struct deflate_seg* seg, oldest;
+	if (com->n_segs == com->segs_cap){ // its histograms are reused
+		oldest = com->segs[0];
+		memmove(com->segs, com->segs + 1, (com->segs_cap - 1) * sizeof(struct deflate_seg));
+		com->segs[--com->n_segs] = oldest;
+	}
+	seg = com->segs + com->n_segs++;
+	seg->start = com->n_toks;
+	seg->bits = bits;
+	seg->extra = com->blk_extra;
+	seg->bytes = com->blk_bytes;
+	hist_reset(&seg->ll);
+	hist_reset(&seg->d);
+}
+
+/* Start a new block with the symbols left in the buffer once the first 'n' are written: the cost model (and ahts) are
+	emptied and given just them
+	'n' is 0 or the start of a segment, or the whole buffer. The segments from there on are kept, with the bits of the new
+		block before each of them counted anew.
+*/
+static void deflate_block_reset(deflate_compr_t* com, int n){
+	struct deflate_seg seg;
+	struct deflate_tok* t, * end;
+	int i, k;
+	com->cost->reset(com);
+	if (com->ahts_too){
+		deflate_aht_reset(com);
+	}
+	com->blk_extra = 0;
+	com->blk_bytes = 0;
+	com->stats_due = 0;
+	for (k = 0; k < com->n_segs && com->segs[k].start < n; k++);
+	for (i = 0; k + i < com->n_segs; i++){ // the ones kept to the front, with the others after them to be reused
+		seg = com->segs[i];
+		com->segs[i] = com->segs[k + i];
+		com->segs[k + i] = seg;
+		com->segs[i].start -= n;
+	}
+	com->n_segs = i;
+	for (i = 0; i < com->n_segs; i++){
+		com->segs[i].bits = (i)? com->cost->bits(com) + com->blk_extra : 0;
+		com->segs[i].extra = com->blk_extra;
+		com->segs[i].bytes = com->blk_bytes;
+		end = com->toks + ((i + 1 < com->n_segs)? com->segs[i + 1].start : com->n_toks);
+		for (t = com->toks + com->segs[i].start; t < end; t++){
+			deflate_cost_add(com, t->ll, t->d);
+		}
+	}
+	if (!com->n_segs || com->segs[com->n_segs - 1].start < com->n_toks){ // the symbols to come start one of their own
+		deflate_seg_open(com, (com->n_toks)? com->cost->bits(com) + com->blk_extra : 0);
+	}
+}
+
+/* Decide whether the current block ends, every DEFLATE_SPLIT_STEP symbols
+	The points at which the block could have ended are DEFLATE_SPLIT_STEP symbols apart, cutting it into segments. The
+		symbols since each of the latest DEFLATE_SPLIT_WINDOW such points (but the block's start) are weighed against those
+		before them. The bits they add to the block going by its cost model (its trees included) are what they cost at the
+		margin. If that is more than they would take as a block of their own, header and all, the input has changed too
+		much for the block's codes to suit them, so the block ends at the point where that saves the most bits, and they
+		start the next one.
+	Weighing a window of segments rather than the latest alone catches a change in the input that each segment on its own
+		is too short to pay a block header for. The histograms of the segments are merged newest to oldest, so each run
+		from a point to the end is priced from histograms in O(the alphabet), without going over its symbols again, and
+		is not priced at all where its entropy alone shows it cannot save more bits than the best so far.
+	Once DEFLATE_BLOCK_TOKS symbols are buffered, the block ends at the latest point anyway.
+*/
+static void deflate_block_plan(deflate_compr_t* com, int flush, int last);
+static void deflate_block_split(deflate_compr_t* com){
+	unsigned int bits, run, extra, gain = 0;
+	int k, cut = 0;
+	if (com->ops & DEFLATE_DP_SPLIT){
+		if (com->n_toks == DEFLATE_DP_TOKS || com->raw_len >= DEFLATE_DP_BYTES){
+			deflate_block_plan(com, 0, 0);
+		}
+		else{
+			deflate_seg_open(com, 0);
+		}
+		return;
+	}
+	bits = com->cost->bits(com) + com->blk_extra;
+	if (com->n_toks == DEFLATE_BLOCK_TOKS){
+		deflate_block_write(com, com->segs[com->n_segs - 1].start, 0);
+		return;
+	}
+	hist_reset(&com->ll_run);
+	hist_reset(&com->d_run);
+	hist_insert(&com->ll_run, 256);
+	for (k = com->n_segs - 1; k >= 0 && com->segs[k].start; k--){
+		hist_merge(&com->ll_run, &com->segs[k].ll);
+		hist_merge(&com->d_run, &com->segs[k].d);
+		extra = com->blk_extra - com->segs[k].extra;
+		if (bits <= com->segs[k].bits + gain + DEFLATE_DYN_HEADER_MIN + hist_bits(&com->ll_run) + hist_bits(&com->d_run) + extra){
+			continue; // cannot do better, as no code beats the entropy
+		}
+		run = com->cost->run_bits(com, &com->ll_run, &com->d_run, extra);
+		if (bits > com->segs[k].bits + run + gain){
+			gain = bits - com->segs[k].bits - run;
+			cut = com->segs[k].start;
+		}
+	}
+	if (cut){
+		deflate_block_write(com, cut, 0);
+		return;
+	}
+	deflate_seg_open(com, bits);
+}
+
+/* DEFLATE_DP_SPLIT: write the buffered symbols as the blocks that take the fewest bits in all, ending at points every
+	DEFLATE_SPLIT_STEP symbols (the segments' starts): all of them if 'flush', the last one marked as the final block if
+	'last'; else those that end at least DEFLATE_BLOCK_TOKS symbols short of the end, as where the others end may yet
+	change with the symbols to come
+	The fewest bits of the blocks up to each point are the fewest, over the blocks of up to DEFLATE_BLOCK_TOKS symbols that
+		end there, of the fewest up to where the block starts plus the block's own bits, counted exactly as dynamic or fixed
+		Huffman codes (see deflate_dyn_codes and deflate_fixed_bits), or stored: most of their chars have slid out of the
+		sliding window by now, so a copy of them is kept in 'raw' (see deflate_tok_add). The blocks from each point are
+		priced going by the histograms of the segments, merged one at a time as the blocks grow; a block whose entropy
+		alone shows it cannot beat the fewest bits found to its end so far is not priced, and neither is one that the
+		histogram cost model prices above storing its chars (incompressible input, where every block would be priced).
+	The blocks are also planned once the symbols cover DEFLATE_DP_BYTES chars, which bounds the copy.
+*/
+static void deflate_block_plan(deflate_compr_t* com, int flush, int last){
+	struct deflate_dyn dy;
+	size_t bits, bytes, * best = com->plan_bits;
+	unsigned int extra;
+	int i, j, k, n, m, * from = com->plan_from;
+	n = com->n_segs - (com->segs[com->n_segs - 1].start == com->n_toks); // but for an empty one at the end
+	for (j = 1; j <= n; j++){
+		best[j] = ~(size_t)0;
+	}
+	best[0] = 0;
+	for (i = 0; i < n; i++){
+		hist_reset(&com->ll_run);
+		hist_reset(&com->d_run);
+		hist_insert(&com->ll_run, 256);
+		for (j = i; j < n && j - i < DEFLATE_BLOCK_TOKS / DEFLATE_SPLIT_STEP; j++){
+			hist_merge(&com->ll_run, &com->segs[j].ll);
+			hist_merge(&com->d_run, &com->segs[j].d);
+			extra = ((j + 1 < com->n_segs)? com->segs[j + 1].extra : com->blk_extra) - com->segs[i].extra;
+			bytes = ((j + 1 < com->n_segs)? com->segs[j + 1].bytes : com->blk_bytes) - com->segs[i].bytes;
+			bits = best[i] + deflate_stored_bits(bytes, 7); // aligned at worst
+			if (best[i] + 3 + hist_bits(&com->ll_run) + hist_bits(&com->d_run) + extra < min(bits, best[j + 1]) // no code beats the entropy
+				&& best[i] + deflate_hist_run_bits(com, &com->ll_run, &com->d_run, extra) < bits){ // nor, most likely, storing it
+				memcpy(dy.ll_freq, com->ll_run.freq, sizeof(dy.ll_freq));
+				memcpy(dy.d_freq, com->d_run.freq, sizeof(dy.d_freq));
+				dy.extra = extra;
+				deflate_dyn_codes(com, &dy);
+				bits = min(bits, best[i] + min(dy.bits, deflate_fixed_bits(dy.ll_freq, dy.d_freq, extra)));
 			}
-			
-			// update sliding window structures
-repeat_copy:
-			for (; i < j; i++, cs.bytes++){
-				// append to new chain
-				dh = com->dup_ht + dup_hash(com->e + i);
-				com->dup_entries[i] = dh->ptr;
-				dh->ptr = i;
-				dh->len++;
-
-				// decrement old chain length
-				if (!first_window){
-					com->dup_ht[dup_hash(com->d + i)].len--;
-				}
-				com->d[i] = com->e[i]; // copy char to old sliding window
-			}
-			if (dup_carry_over > 0){ // dup match goes beyond sliding window; copy chars into beginning of next sliding window
-				i = 0;
-				j = dup_carry_over;
-				dup_carry_over = -1; // ensures control flow will fall into the "else if" next time
-				com->e[0] = com->e[com->sliding_window];
-				com->e[1] = com->e[com->sliding_window + 1];
-				// if the string breached past sliding window + 1, fetch_ahead had brought in the chars past e + 1
-				goto repeat_copy;
-			}
-			else if (dup_carry_over < 0){ // did a wrap around, break out to move to the next sliding window
-				break;
+			if (bits < best[j + 1]){
+				best[j + 1] = bits;
+				from[j + 1] = i;
 			}
-			
 		}
-		if (!com->read_ahead){ // did not breach next sliding window; reset i to the beginning for next sliding window
-			com->e[0] = com->e[com->sliding_window];
-			com->e[1] = com->e[com->sliding_window + 1];
-			i = 0;
+	}
+	
+	// the ends of the blocks, found back to front
+	for (j = n, m = 0; j > 0; j = from[j]){
+		best[m++] = j; // no longer needed, as m <= j
+	}
+	for (i = 0, k = m - 1; k >= 0 && (flush || best[k] <= n - DEFLATE_BLOCK_TOKS / DEFLATE_SPLIT_STEP); k--, i = j){
+		j = best[k];
+		deflate_block_out(com, com->toks + com->segs[i].start, ((j < com->n_segs)? com->segs[j].start : com->n_toks) - com->segs[i].start, last && !k);
+	}
+	if (flush && !n){ // nothing buffered, but there is a block to end the stream with
+		deflate_block_out(com, com->toks, 0, last);
+	}
+	i = (i < com->n_segs)? com->segs[i].start : com->n_toks;
+	memmove(com->toks, com->toks + i, (com->n_toks - i) * sizeof(struct deflate_tok));
+	com->n_toks -= i;
+	deflate_block_reset(com, i);
+	com->raw_len -= com->blk_pos - com->raw_pos;
+	memmove(com->raw, com->raw + (com->blk_pos - com->raw_pos), com->raw_len);
+	com->raw_pos = com->blk_pos;
+}
+
+// Buffer a literal ('d' == 0) or len/dist pair in the latest segment, and see whether the block ends (see deflate_block_split)
+//	With DEFLATE_DP_SPLIT, the chars it covers are copied too, from the sliding window, where they still are
+static inline void deflate_tok_add(deflate_compr_t* com, int ll, int d){
+	struct deflate_seg* seg = com->segs + com->n_segs - 1;
+	unsigned char* raw;
+	if (com->raw){
+		if (com->raw_len + MAXLEN > com->raw_cap){ // what is left after a plan may cover a lot of long matches
+			if (!(raw = realloc(com->raw, com->raw_cap << 1))){
+				fail_out(E_MALLOC);
+			}
+			com->raw = raw;
+			com->raw_cap <<= 1;
 		}
-		first_window = 0;
+		memcpy(com->raw + com->raw_len, com->e + (com->raw_pos + com->raw_len - com->pos), (d)? ll : 1);
+		com->raw_len += (d)? ll : 1;
+	}
+	com->toks[com->n_toks].ll = ll;
+	com->toks[com->n_toks].d = d;
+	if (!d){
+		hist_insert(&seg->ll, ll);
+	}
+	else{
+		hist_insert(&seg->ll, len_sym[ll].sym);
+		hist_insert(&seg->d, DIST_SYM(d));
+	}
+	if (!(++com->n_toks & (DEFLATE_SPLIT_STEP - 1))){
+		deflate_block_split(com);
 	}
 }
 
-//int main(){ // dummy main that will 100% segfault
-//	deflate_compr_init(NULL, 0, 0, 1);
-//	process_loop(NULL, NULL);
-//	return 0;
-//}
+// Get the zlib header (rfc1950 2.2) for a sliding window 'sw' and compression level 'level', with FDICT if 'fdict', as CMF | FLG << 8
+static unsigned int deflate_header(swi sw, int level, int fdict){
+	unsigned int cmf, flg;
+	cmf = 8 | ((31 - __builtin_clz(sw) - 8) << 4); // CM = 8 (deflate), CINFO = log2(sliding window) - 8
+	if (level == 1){
+		flg = 0 << 6; // FLEVEL = 0 (fastest algorithm)
+	}
+	else if (level < DEFLATE_LEVEL_DEFAULT){
+		flg = 1 << 6; // FLEVEL = 1 (fast algorithm)
+	}
+	else if (level == DEFLATE_LEVEL_DEFAULT){
+		flg = 2 << 6; // FLEVEL = 2 (default algorithm)
+	}
+	else{
+		flg = 3 << 6; // FLEVEL = 3 (maximum compression)
+	}
+	if (fdict){
+		flg |= 1 << 5; // FDICT
+	}
+	flg |= (31 - ((cmf << 8) | flg) % 31) % 31; // FCHECK
+	return cmf | (flg << 8);
+}
 
-/* Performs deflate compression with a sliding window 'sw' using the file descriptors:
-	'fd_in' - input (uncompressed) data
-	'fd_out' - output (compressed) data
-	'fd_stats' - statistics written here (else -1)
+// Write the zlib header (rfc1950 2.2)
+static void deflate_write_header(deflate_compr_t* com){
+	bit_writer_put(&com->bw, deflate_header(com->sliding_window, com->level, com->dict_len != 0), 16);
+	if (com->dict_len){
+		bit_writer_put(&com->bw, __builtin_bswap32(com->dictid), 32); // DICTID, most significant byte first
+	}
+}
+
+// End the current block with a sync flush: an empty stored block, which leaves the output at a byte boundary (see rfc1951 3.2.4)
+static void deflate_sync_flush(deflate_compr_t* com){
+	bit_writer_put(&com->bw, 0, 3); // BFINAL = 0, BTYPE = 00
+	bit_writer_align(&com->bw);
+	bit_writer_put(&com->bw, 0xffff0000, 32); // LEN = 0, NLEN = ~0
+}
+
+// Write the zlib trailer (adler32 checksum, most significant byte first) and flush everything to 'fd_out'
+static void deflate_write_trailer(deflate_compr_t* com){
+	bit_writer_align(&com->bw);
+	bit_writer_put(&com->bw, __builtin_bswap32(com->adler), 32);
+	bit_writer_align(&com->bw);
+	bit_writer_flush(&com->bw);
+}
 
-	ops: 1 means write a null character at the end
+/* Binary tree match finder (DEFLATE_BT), after LZMA's BT3
+	The positions with the same dup_hash form a binary search tree ordered by the strings starting at them. Position 'i' of the
+		current sliding window is searched for and inserted in a single walk down its tree: it becomes the new root, and every
+		node passed on the way is hung to its left or right depending on whether its string is less or greater, so each walk
+		only visits the nodes closest to the new string rather than the whole hash chain. 'len0' and 'len1' are how much the
+		new string is known to have in common with everything on the left and right, so comparisons start past that.
+	Nodes are absolute positions, so a node 'sliding_window' or more positions back has slid out and ends the walk, as does
+		one at or before the start of the former sliding window when 'i' is in it (a preset dictionary, or positions left
+		out before a sync flush), and 0, the position of a missing child, which is always one or the other since positions
+		start at 'sliding_window'. Its two children are kept in 'bt_son' at its position modulo the sliding window, which
+		only a node that has slid out could share.
+	The walk stops at 'chain' nodes, or at a string matching the first nice_len chars; that node is then replaced by the new
+		one, which matches it as far as any later search can tell. This limit must be the same for every walk (short of the
+		end of the input) for the trees to stay ordered, so a smaller 'lim' only cuts off the dup strings put in 'cands'.
+		So when 'more' input is yet to come after a sync flush, a string cut off by the end of the input so far is only
+		searched for, leaving the trees as they are, and is inserted once the input past it is in (see deflate_compr_push).
+	Puts every dup string longer than the ones before it (at most 'lim' chars) in 'cands', as find_dups does, unless 'cands'
+		is NULL (insertion only). The longest one is extended past nice_len by check_dup_str if it got cut off there.
 */
-int deflate_compress(int fd_in, int fd_out, int fd_stats, swi sw, int ops){ // STDIN_FILENO, STDOUT_FILENO
-	deflate_compr_t* com;
-	struct h_tree_builder htb;
-	com = spawn_deflate_compr_t();
-	deflate_compr_init(com, fd_in, fd_out, fd_stats, sw);
-	h_tree_builder_init(&htb, 19);
-	if (!fail_checkpoint()){
-		process_loop(com, &htb);
+static int bt_find(deflate_compr_t* com, int i, int lim, int chain, struct dup_cand* cands){
+	size_t cur = com->pos + i, match, delta;
+	size_t reach = com->sliding_window + min(i, 0); // nodes this far back or more end the walk
+	size_t* pair, * ptr0, * ptr1;
+	const unsigned char* p = com->e + i, * q;
+	unsigned int h = dup_hash(p);
+	int len, len0 = 0, len1 = 0, max_len = 2, n = 0, tree_lim, insert;
+	tree_lim = min(com->bound - p, MAXLEN);
+	lim = min(lim, tree_lim);
+	insert = !com->more || tree_lim >= com->lvl->nice_len;
+	tree_lim = min(tree_lim, com->lvl->nice_len);
+	if (!insert && !cands){
+		return 0;
 	}
-fail:
-	fail_uncheckpoint();
-	deflate_compr_deinit(com);
-	htb_deinit(&htb);
-	free(com);
+	
+	match = com->head[h];
+	ptr0 = ptr1 = NULL;
+	if (insert){
+		com->head[h] = cur;
+		ptr0 = com->bt_son + 2 * (cur & (com->sliding_window - 1)) + 1;
+		ptr1 = com->bt_son + 2 * (cur & (com->sliding_window - 1));
+	}
+	for (;;){
+		delta = cur - match;
+		if (!chain-- || delta >= reach){
+			if (insert){
+				*ptr0 = *ptr1 = 0;
+			}
+			break;
+		}
+		pair = com->bt_son + 2 * (match & (com->sliding_window - 1));
+		q = p - delta;
+		len = min(len0, len1);
+		if (q[len] == p[len]){
+			len = dup_str_len(p, q, len + 1, tree_lim);
+			if (cands && len > max_len && max_len < lim){
+				max_len = len;
+				cands[n].len = min(len, lim);
+				cands[n++].dist = delta;
+			}
+			if (len == tree_lim){ // take the place of 'match'
+				if (insert){
+					*ptr1 = pair[0];
+					*ptr0 = pair[1];
+				}
+				break;
+			}
+		}
+		if (q[len] < p[len]){
+			if (insert){
+				*ptr1 = match;
+				ptr1 = pair + 1;
+			}
+			match = pair[1];
+			len1 = len;
+		}
+		else{
+			if (insert){
+				*ptr0 = match;
+				ptr0 = pair;
+			}
+			match = pair[0];
+			len0 = len;
+		}
+	}
+	if (insert){
+		com->bt_next = cur + 1;
+	}
+	if (n && cands[n - 1].len == tree_lim && tree_lim < lim){
+		cands[n - 1].len = min(check_dup_str(com, p, p - cands[n - 1].dist), lim);
+	}
+	return n;
+}
+
+// Bring the hash chains (or binary trees) up to date with positions 'i' through 'j' - 1 of the current sliding window
+static void update_sliding_window(deflate_compr_t* com, int i, int j){
+	size_t* h;
+	if (com->strategy == DEFLATE_RLE || com->strategy == DEFLATE_HUFFMAN_ONLY){ // never searches the hash chains
+		return;
+	}
+	if (com->ops & DEFLATE_BT){
+		if (com->pos + i < com->bt_next){ // skip those already inserted by a search
+			i = com->bt_next - com->pos;
+		}
+		for (; i < j; i++){
+			bt_find(com, i, MAXLEN, com->lvl->max_chain, NULL);
+		}
+		return;
+	}
+	for (; i < j; i++){
+		h = com->head + dup_hash(com->e + i);
+		com->prev[(com->pos + i) & (com->sliding_window - 1)] = *h;
+		*h = com->pos + i;
+	}
+}
+
+// Walk up to 'chain' entries of the hash chain of position 'i' of the current sliding window for the longest dup string
+//	longer than 'max_len'; returns its length (or 'max_len' if there is none) and puts its distance in '*dist'
+//	With DEFLATE_BT, walks up to 'chain' nodes of its binary tree instead, which also inserts position 'i'
+static int find_dup(deflate_compr_t* com, int i, int max_len, int chain, int* dist){
+	int j, t; // j is the loop iterator, t is a scratch variable
+	size_t cur = com->pos + i, p; // absolute positions of the current char and the hash chain element
+	struct dup_cand cands[MAXLEN];
+	if (com->ops & DEFLATE_BT){
+		j = bt_find(com, i, MAXLEN, chain, cands);
+		if (j && cands[j - 1].len > max_len){
+			max_len = cands[j - 1].len;
+			*dist = cands[j - 1].dist;
+		}
+		return max_len;
+	}
+	p = com->head[dup_hash(com->e + i)];
+	for (j = 0; j < chain && cur - p < com->sliding_window; j++){ // loop through hash chain until it slides out
+		// check for dup string and save if it's the longest
+		t = check_dup_str(com, com->e + i, com->e + i - (cur - p));
+		if (t > max_len){
+			max_len = t;
+			*dist = cur - p;
+			if (t >= com->lvl->nice_len){ // good enough
+				break;
+			}
+		}
+		p = com->prev[p & (com->sliding_window - 1)]; // proceed to next hash element
+	}
+	return max_len;
+}
+
+// Walk up to 'chain' entries of the hash chain of position 'i' of the current sliding window, putting every dup string that
+//	is longer than the ones before it (at most 'lim' chars) in 'cands'; returns how many there are
+//	Since the chain goes from nearest to farthest, each one is the nearest dup string of its length or any shorter length
+static int find_dups(deflate_compr_t* com, int i, int lim, int chain, struct dup_cand* cands){
+	int j, t, n = 0, max_len = 2;
+	size_t cur = com->pos + i, p;
+	if (com->ops & DEFLATE_BT){
+		return bt_find(com, i, lim, chain, cands);
+	}
+	p = com->head[dup_hash(com->e + i)];
+	for (j = 0; j < chain && cur - p < com->sliding_window; j++){
+		t = min(check_dup_str(com, com->e + i, com->e + i - (cur - p)), lim);
+		if (t > max_len){
+			max_len = t;
+			cands[n].len = t;
+			cands[n++].dist = cur - p;
+			if (t >= com->lvl->nice_len || t == lim){
+				break;
+			}
+		}
+		p = com->prev[p & (com->sliding_window - 1)];
+	}
+	return n;
+}
+
+/* Emit a literal ('d' == 0) or len/dist pair: buffer it for the block, and keep the ahts and statistics up to date
+	The tree bits in the statistics take a Huffman tree build over the code length code, so rather than after every
+		symbol they are counted anew every DEFLATE_STATS_REFRESH symbols, whenever a symbol first shows up in the block
+		(which brings in a code length, and changes HLIT, HDIST and the runs of zeros), and once a block ends. In between,
+		only the depths of the symbols already in the ahts shift, by a bit here and there as their weights grow, so the
+		tree bits written lag behind by a few bits of the code lengths' encoding; the symbol bits are always exact.
+*/
+static void emit(deflate_compr_t* com, struct h_tree_builder* htb, struct compress_stats* cs, int ll, int d){
+	int fresh = 0; // bool, the symbol is new to the block
+	if (com->fd_stats >= 0){
+		fresh = !com->ll_aht.tree[(d)? len_sym[ll].sym : ll].weight || (d && !com->d_aht.tree[DIST_SYM(d)].weight);
+	}
+	deflate_cost_add(com, ll, d);
+	deflate_tok_add(com, ll, d); // after the cost model, since a new block starts it over with the symbols it keeps
+	
+	if (com->fd_stats >= 0){
+		if (fresh || !com->stats_due--){
+			h_tree_builder_reset(htb);
+			cs->tree_bits = h_tree_d_lens(htb->q, &com->ll_aht, &com->d_aht, NULL);
+			h_tree_builder_build(htb);
+			cs->tree_bits += h_tree_builder_score(htb);
+			com->stats_due = DEFLATE_STATS_REFRESH - 1;
+		}
+		
+		cs->ll_bits = com->ll_aht.score;
+		cs->d_bits = com->d_aht.score;
+		
+		cs->ll = ll; // lit character or len
+		cs->d = d; // 0 to indicate this is a literal, else dist
+		write(com->fd_stats, cs, sizeof(*cs));
+	}
+	cs->bytes += (d)? ll : 1;
+}
+
+// Expected number of bits of symbol 's' going by 'aht': its depth, or if it has not been seen yet,
+//	the depth of the nyt node plus the bits telling which symbol it is
+static unsigned int opt_aht_cost(const struct aht* aht, int s){
+	if (aht->tree[s].weight){
+		return aht->tree[s].depth;
+	}
+	return aht->tree[aht->nyt].depth + 32 - __builtin_clz(aht->sz - 1);
+}
+
+// Fill in 'oc' from the code lengths 'll_lens' and 'd_lens' of a block; unused symbols cost as much as the longest code
+//	Without 'll_lens', go by the depths of the ahts instead, that is, the statistics of the current block so far
+static void opt_costs_init(deflate_compr_t* com, struct opt_costs* oc, const unsigned char* ll_lens, const unsigned char* d_lens){
+	int i, s;
+	for (i = 0; i < 256; i++){
+		oc->lit[i] = (!ll_lens)? opt_aht_cost(&com->ll_aht, i) : (ll_lens[i])? ll_lens[i] : 15;
+	}
+	for (i = 3; i <= MAXLEN; i++){
+		s = len_sym[i].sym;
+		oc->len[i] = len_sym[i].eb + ((!ll_lens)? opt_aht_cost(&com->ll_aht, s) : (ll_lens[s])? ll_lens[s] : 15);
+	}
+	for (i = 0; i < NUM_DIST_CODES; i++){
+		oc->dist[i] = dist_eb[i] + ((!d_lens)? opt_aht_cost(&com->d_aht, i) : (d_lens[i])? d_lens[i] : 15);
+	}
+}
+
+// Find the cheapest parse of positions 'i' through 'n' - 1 going by 'oc', put it in 'opt.path', and return its length
+static int opt_shortest_path(deflate_compr_t* com, const struct opt_costs* oc, int i, int n){
+	struct deflate_opt* o = &com->opt;
+	struct dup_cand* dc;
+	struct deflate_tok t;
+	unsigned int c, dc_cost;
+	int p, k, len;
+	for (p = i + 1; p <= n; p++){
+		o->cost[p] = -1;
+	}
+	o->cost[i] = 0;
+	for (p = i; p < n; p++){
+		c = o->cost[p] + oc->lit[com->e[p]];
+		if (c < o->cost[p + 1]){
+			o->cost[p + 1] = c;
+			o->step[p + 1].ll = com->e[p];
+			o->step[p + 1].d = 0;
+		}
+		len = 3;
+		for (dc = o->cands + o->cand_idx[p]; dc < o->cands + o->cand_idx[p + 1]; dc++){
+			// every length up to this dup string's that was not reached by a nearer one comes from this one
+			dc_cost = o->cost[p] + oc->dist[DIST_SYM(dc->dist)];
+			for (; len <= dc->len; len++){
+				c = dc_cost + oc->len[len];
+				if (c < o->cost[p + len]){
+					o->cost[p + len] = c;
+					o->step[p + len].ll = len;
+					o->step[p + len].d = dc->dist;
+				}
+			}
+		}
+	}
+	// trace the path back from n, then turn it around
+	for (p = n, k = 0; p > i; k++){
+		o->path[k] = o->step[p];
+		p -= (o->step[p].d)? o->step[p].ll : 1;
+	}
+	for (p = 0; p < k / 2; p++){
+		t = o->path[p];
+		o->path[p] = o->path[k - 1 - p];
+		o->path[k - 1 - p] = t;
+	}
+	return k;
+}
+
+// Price the parse 'path' of 'k' symbols with the Huffman code it would get as a block on its own, and put that code's
+//	costs in 'oc'; returns the number of bits of the parse's symbols
+static unsigned long opt_path_price(deflate_compr_t* com, const struct deflate_tok* path, int k, struct opt_costs* oc){
+	unsigned int ll_freq[NUM_LITLEN_CODES] = {0}, d_freq[NUM_DIST_CODES] = {0};
+	unsigned char ll_lens[NUM_LITLEN_CODES], d_lens[NUM_DIST_CODES];
+	unsigned long ret = 0;
+	int j;
+	for (j = 0; j < k; j++){
+		if (!path[j].d){
+			ll_freq[path[j].ll]++;
+		}
+		else{
+			ll_freq[len_sym[path[j].ll].sym]++;
+			d_freq[DIST_SYM(path[j].d)]++;
+		}
+	}
+	ll_freq[256] = 1;
+	deflate_tree_lens(&com->ll_htb, ll_freq, ll_lens, 15);
+	deflate_tree_lens(&com->d_htb, d_freq, d_lens, 15);
+	opt_costs_init(com, oc, ll_lens, d_lens);
+	for (j = 0; j < k; j++){
+		ret += (!path[j].d)? oc->lit[path[j].ll] : oc->len[path[j].ll] + oc->dist[DIST_SYM(path[j].d)];
+	}
+	return ret;
+}
+
+/* Parse positions 'i' through 'n' - 1 of the current sliding window with the fewest bits, rather than a match at a time
+	(the optimal strategy, after zopfli's squeeze)
+	First, every dup string worth considering at each position is found through find_dups, bringing the hash chains up to
+		date along the way. Each position then has a candidate literal and, for each length from 3 up to its longest dup
+		string, the nearest len/dist pair of that length, each of which costs some number of bits. The cheapest parse is the
+		shortest path from 'i' to 'n' over these, found in one pass since every edge goes forward.
+	What each symbol costs depends on the parse, though. The first parse is priced by the depths of the ahts; every later one
+		is priced by the code lengths the block would have with the frequencies of the parse before it. This is repeated
+		until a parse is no cheaper than the best one so far (or DEFLATE_OPT_ITERATIONS times), and the best one is emitted.
+	Dup strings are cut off at the end of the window, so the parse never carries over into the next one.
+	Returns 'n'.
+*/
+static int parse_optimal(deflate_compr_t* com, struct h_tree_builder* htb, struct compress_stats* cs, int i, int n){
+	struct deflate_opt* o = &com->opt;
+	struct opt_costs oc;
+	struct dup_cand* cands;
+	struct deflate_tok* t;
+	unsigned long price, best_price = -1;
+	int p, k, best_k = 0, it;
+	
+	o->n_cands = 0;
+	for (p = i; p < n; p++){
+		if (o->n_cands + MAXLEN > o->cands_cap){ // room for the most dup strings one position can have
+			o->cands_cap *= 2;
+			if (!(cands = realloc(o->cands, o->cands_cap * sizeof(struct dup_cand)))){
+				fail_out(E_MALLOC);
+			}
+			o->cands = cands;
+		}
+		o->cand_idx[p] = o->n_cands;
+		o->n_cands += find_dups(com, p, n - p, com->lvl->max_chain, o->cands + o->n_cands);
+		update_sliding_window(com, p, p + 1);
+	}
+	o->cand_idx[n] = o->n_cands;
+	
+	opt_costs_init(com, &oc, NULL, NULL);
+	for (it = 0; it < DEFLATE_OPT_ITERATIONS; it++){
+		k = opt_shortest_path(com, &oc, i, n);
+		price = opt_path_price(com, o->path, k, &oc);
+		if (price >= best_price){
+			break;
+		}
+		best_price = price;
+		best_k = k;
+		t = o->best;
+		o->best = o->path;
+		o->path = t;
+	}
+	for (t = o->best; t < o->best + best_k; t++){
+		emit(com, htb, cs, t->ll, t->d);
+	}
+	return n;
+}
+
+/* Parse positions 'i' through 'n' - 1 of the current sliding window greedily with one probe per position (the fast
+	strategy, after LZ4)
+	Only the head of the hash chain of each position is checked, and a dup string found there is taken right away; the
+		positions it covers are not inserted into the hash chains. After 1 << DEFLATE_FAST_SKIP misses in a row, the positions
+		in between probes start being stepped over as literals, one more at a time for every 1 << DEFLATE_FAST_SKIP misses,
+		so that input with nothing to find (already compressed data) goes by quickly.
+	Returns the position after the last one parsed, which may be past 'n' (see process_loop).
+*/
+static int parse_fast(deflate_compr_t* com, struct h_tree_builder* htb, struct compress_stats* cs, int i, int n){
+	size_t* h;
+	size_t cur, p; // absolute positions of the current char and the head of its hash chain
+	int len, step, misses = 0;
+	while (i < n){
+		h = com->head + dup_hash(com->e + i);
+		cur = com->pos + i;
+		p = *h;
+		*h = cur;
+		if (cur - p < com->sliding_window){
+			len = check_dup_str(com, com->e + i, com->e + i - (cur - p));
+			if (len > 3 || (len == 3 && cur - p <= TOO_FAR)){
+				emit(com, htb, cs, len, cur - p);
+				i += len;
+				misses = 0;
+				continue;
+			}
+		}
+		for (step = min(1 + (misses++ >> DEFLATE_FAST_SKIP), n - i); step; step--, i++){
+			emit(com, htb, cs, com->e[i], 0);
+		}
+	}
+	return i;
+}
+
+/* Parse positions 'i' through 'n' - 1 of the current sliding window greedily, looking for dup strings only at the distances in
+	RLE_DISTS (the rle strategy, like zlib's Z_RLE but for whole pixels too)
+	Runs of a byte or of a pixel in image scanlines and sparse binary data are found without any hash chain: the only
+		memory touched is the window right behind the current position.
+	Returns the position after the last one parsed, which may be past 'n' (see process_loop).
+*/
+static int parse_rle(deflate_compr_t* com, struct h_tree_builder* htb, struct compress_stats* cs, int i, int n){
+	int k, t, len, dist = 0;
+	while (i < n){
+		len = 2;
+		for (k = 0; k < sizeof(RLE_DISTS) && com->pos + i >= com->sliding_window - com->dict_len + RLE_DISTS[k]; k++){ // not before the input
+			t = check_dup_str(com, com->e + i, com->e + i - RLE_DISTS[k]);
+			if (t > len){
+				len = t;
+				dist = RLE_DISTS[k];
+			}
+		}
+		if (len >= 3){
+			emit(com, htb, cs, len, dist);
+			i += len;
+		}
+		else{
+			emit(com, htb, cs, com->e[i], 0);
+			i++;
+		}
+	}
+	return i;
+}
+
+// Emit positions 'i' through 'n' - 1 of the current sliding window as literals (the huffman only strategy)
+//	The blocks then only do entropy coding, with codes built from the byte frequencies; returns 'n'
+static int parse_huffman_only(deflate_compr_t* com, struct h_tree_builder* htb, struct compress_stats* cs, int i, int n){
+	for (; i < n; i++){
+		emit(com, htb, cs, com->e[i], 0);
+	}
+	return n;
+}
+
+/* Search for dup strings through the input and emit the resulting literals and len/dist pairs
+	Matches are evaluated lazily, as in zlib: once the longest match at position i is found, it is only taken right away if
+		it is at least the level's 'lazy' length. Otherwise it is held back while position i + 1 is searched, and if that turns
+		up a longer match, a literal is emitted for position i and the match at i + 1 is held back in turn. With a 'lookahead'
+		of 2, a match that position i + 1 does not beat is held back once more while position i + 2 is searched, which must
+		then turn up a match longer by 2 to be worth the two literals before it.
+	Levels with a 'lazy' length of 0 take every match right away (greedy), and may leave all but the first position of a
+		long one out of the hash chains (see struct deflate_level).
+	The optimal strategy parses each sliding window as a whole instead (see parse_optimal), and the fast strategy probes
+		once per position (see parse_fast), and the rle strategy only looks right behind (see parse_rle).
+	The huffman only strategy does not search at all (see parse_huffman_only).
+	Returns 1 once the input has run out and the last block is written. With 'wait' (see fetch), it may have to stop
+		before that for more input; it then returns 0, having kept where it left off in 'com' to pick up from on the next call.
+*/
+int process_loop(deflate_compr_t* com, struct h_tree_builder* htb){
+	int i = com->i, j; // i is the current position in the sliding window, j is a scratch variable
+	int n; // number of positions in this sliding window
+	
+	struct compress_stats cs = com->cs;
+	
+	int max_len; // maximum dup match length found at position i
+	int dist = 0; // distance of that match
+	int adv; // number of positions to advance
+	int ins; // number of those to insert into the hash chains
+	int chain; // number of hash chain entries to check
+	int prev_len = com->prev_len; // match length held back from position i - 1 (< 3 for a literal)
+	int prev_dist = com->prev_dist; // distance of that match
+	int held = com->held; // number of positions the held back match is behind position i (0: none)
+	
+	if (com->stage != PL_WINDOWS){ // the first MAXLEN chars
+		if (!fetch(com, com->e, MAXLEN)){
+			return 0;
+		}
+		if (com->stage == PL_BEGIN){
+			deflate_block_reset(com, 0); // the end of block code, which will always be there once
+			update_sliding_window(com, -(int)com->dict_len, 0); // the preset dictionary, if any
+		}
+		else if (com->ops & DEFLATE_BT){ // the positions left out of the binary trees before a sync flush (see bt_find)
+			update_sliding_window(com, -(int)(com->pos - com->bt_next), 0);
+		}
+		com->stage = PL_WINDOWS;
+	}
+	for (;;){
+		if (!com->done && !fetch(com, com->e + MAXLEN, com->sliding_window)){ // read next sliding window into 'e' + MAXLEN
+			com->i = i;
+			com->held = held;
+			com->prev_len = prev_len;
+			com->prev_dist = prev_dist;
+			com->cs = cs;
+			return 0;
+		}
+		n = min(com->bound - com->e, com->sliding_window);
+		update_sliding_window(com, 0, i); // chars of a dup string carried over from the previous window
+		if (com->strategy == DEFLATE_OPTIMAL){
+			i = parse_optimal(com, htb, &cs, i, n);
+		}
+		else if (com->strategy == DEFLATE_FAST){
+			i = parse_fast(com, htb, &cs, i, n);
+		}
+		else if (com->strategy == DEFLATE_RLE){
+			i = parse_rle(com, htb, &cs, i, n);
+		}
+		else if (com->strategy == DEFLATE_HUFFMAN_ONLY){
+			i = parse_huffman_only(com, htb, &cs, i, n);
+		}
+		for (; i < n;){ // for each character in sliding window
+			chain = com->lvl->max_chain;
+			if (held && prev_len >= com->lvl->good_len){ // already have a good match; don't look as hard for a better one
+				chain >>= 2;
+			}
+			j = (held)? max(prev_len + held - 1, 2) : 2; // need at least 3 to make len/dist worth it, and must beat what is held back
+			max_len = find_dup(com, i, j, chain, &dist);
+			if (max_len == j || (max_len == 3 && dist > TOO_FAR)){ // nothing (worthwhile) found
+				max_len = 2;
+			}
+			
+			ins = 1;
+			if (held && prev_len >= 3 && max_len < 3 && held < com->lvl->lookahead){ // see what position i + 1 has too
+				adv = 1;
+				held++;
+			}
+			else if (held && prev_len >= 3 && max_len < 3){ // the held back match stands; emit it from position i - held
+				emit(com, htb, &cs, prev_len, prev_dist);
+				adv = ins = prev_len - held;
+				held = 0;
+			}
+			else{
+				for (; held; held--){ // the positions held back lost out to position i, so they are literals
+					emit(com, htb, &cs, com->e[i - held], 0); // e[-1] is the last char of the previous window
+				}
+				if (max_len >= 3 && max_len >= com->lvl->lazy){ // long enough to take right away
+					emit(com, htb, &cs, max_len, dist);
+					adv = max_len;
+					if (!com->lvl->max_insert || max_len <= com->lvl->max_insert){
+						ins = adv;
+					}
+				}
+				else{ // hold it back and see what position i + 1 has
+					prev_len = max_len;
+					prev_dist = dist;
+					adv = 1;
+					held = 1;
+				}
+			}
+			
+			// update sliding window structures; chars past the end of the window are carried over to the next one
+			j = min(i + ins, com->sliding_window);
+			update_sliding_window(com, i, j);
+			i += adv;
+		}
+		if (com->bound - com->e <= com->sliding_window){ // no spillover; the input is exhausted
+			break;
+		}
+		rotate_sliding_window(com);
+		i -= com->sliding_window;
+	}
+	for (; held; held--){ // the last chars of the input
+		emit(com, htb, &cs, com->e[i - held], 0);
+	}
+	if (com->ops & DEFLATE_DP_SPLIT){
+		deflate_block_plan(com, 1, com->last);
+	}
+	else{
+		deflate_block_write(com, com->n_toks, com->last);
+	}
+	if (!com->last){
+		deflate_sync_flush(com);
+	}
+	com->cs = cs;
+	return 1;
+}
+
+//int main(){ // dummy main that will 100% segfault
+//	deflate_compr_init(NULL, 0, 0, 1);
+//	process_loop(NULL, NULL);
+//	return 0;
+//}
+
+/* Performs deflate compression with a sliding window 'sw' using the file descriptors:
+	'fd_in' - input (uncompressed) data
+	'fd_out' - output (compressed) data
+	'fd_stats' - statistics written here (else -1)
+	
+	level: 1 (fastest) through DEFLATE_MAX_LEVEL (smallest output); DEFLATE_LEVEL_DEFAULT balances the two
+	strategy: DEFLATE_DEFAULT parses lazily (or greedily) as the level says; DEFLATE_OPTIMAL finds the cheapest parse of
+		each sliding window in bits, many times slower but smaller, searching as hard as the level says; DEFLATE_FAST
+		takes the first dup string it probes for and speeds through input with nothing to find, whatever the level;
+		DEFLATE_RLE only repeats the last 1, 2, 3, 4, 6, or 8 chars (image and sparse data), whatever the level;
+		DEFLATE_HUFFMAN_ONLY writes every char as a literal, for input with nothing but skewed byte frequencies to exploit
+	ops: DEFLATE_BT searches for dup strings with binary trees rather than hash chains (see bt_find), only with DEFLATE_DEFAULT and DEFLATE_OPTIMAL;
+		DEFLATE_AHT decides where blocks end with the adaptive Huffman tree cost model, which the optimal strategy and
+		statistics use unless DEFLATE_HIST asks for the histogram one that the rest use (see struct deflate_cost_model);
+		DEFLATE_DP_SPLIT decides where blocks end by dynamic programming over many blocks of symbols at once, for smaller
+		output at a few times the cost (see deflate_block_plan)
+*/
+int deflate_compress(int fd_in, int fd_out, int fd_stats, swi sw, int level, int strategy, int ops){ // STDIN_FILENO, STDOUT_FILENO
+	return deflate_compress_dict(fd_in, fd_out, fd_stats, sw, level, strategy, ops, NULL);
+}
+
+/* Map the rest of 'fd' into memory, to be read straight out of rather than through read(); returns NULL if it is not a
+	regular file (a pipe, a socket, ...), there is nothing left of it, or it cannot be mapped
+	The whole file is mapped, '*map_len' bytes of it, with the rest of it starting at '*off'.
+*/
+static unsigned char* map_input(int fd, size_t* map_len, size_t* off){
+	struct stat st;
+	off_t cur;
+	unsigned char* map;
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) || (cur = lseek(fd, 0, SEEK_CUR)) < 0 || cur >= st.st_size){
+		return NULL;
+	}
+	if ((map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED){
+		return NULL;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL); // only a hint; read ahead, and drop pages once passed
+	*map_len = st.st_size;
+	*off = cur;
+	return map;
+}
+
+/* Performs deflate compression as deflate_compress does, with the preset dictionary 'dict' (NULL or empty for none)
+	Dup strings may refer back into the last 'sw' chars of 'dict', which pays off for small inputs that share strings with it.
+	The output can only be decompressed with the same dictionary (see deflate_decompress_dict).
+	If 'fd_in' is a regular file, it is mapped into memory and searched right there (see deflate_compr_src), rather than
+		read() a window at a time into the sliding window; it is left past what was mapped afterwards, as it would be by read().
+*/
+int deflate_compress_dict(int fd_in, int fd_out, int fd_stats, swi sw, int level, int strategy, int ops, const struct string_len* dict){
+	int ret;
+	deflate_compr_t* com;
+	unsigned char* map;
+	size_t map_len, off;
+	com = spawn_deflate_compr_t();
+	if ((ret = deflate_compr_init(com, fd_in, fd_out, fd_stats, sw, level, strategy, ops))){
+		free(com);
+		return ret;
+	}
+	map = map_input(fd_in, &map_len, &off);
+	if (!(ret = fail_checkpoint())){
+		if (dict && dict->len){
+			deflate_compr_dict(com, dict->str, dict->len);
+		}
+		if (map){
+			deflate_compr_src(com, map + off, map_len - off);
+		}
+		deflate_write_header(com);
+		process_loop(com, &com->cl_htb);
+		deflate_write_trailer(com);
+	}
+	fail_uncheckpoint();
+	if (map){
+		munmap(map, map_len);
+		lseek(fd_in, map_len, SEEK_SET);
+	}
+	deflate_compr_deinit(com);
+	free(com);
+	return ret;
+}
+
+/* Performs deflate compression as deflate_compress does, a piece of input at a time, with 'com' (see deflate_compr_init;
+	with -1 for each fd, and deflate_compr_dict for a preset dictionary). Takes input from the 'in_len' bytes at 'in',
+	setting '*in_used' to the number taken, and writes zlib data to the 'out_cap' bytes at 'out', setting '*out_len' to
+	the number written. Returns 0, DEFLATE_STREAM_END once the whole stream has been written out, or an error.
+	flush: DEFLATE_NO_FLUSH keeps the input of a sliding window until the whole window is in, so that it is parsed as
+		deflate_compress would; DEFLATE_SYNC_FLUSH compresses all the input so far and ends it with an empty stored block
+		(see deflate_compress_parallel), so that everything written out so far can be decompressed; DEFLATE_FINISH ends
+		the stream once the input runs out.
+	Input is only taken once the output of the input before it has all been written out, so with DEFLATE_SYNC_FLUSH and
+		DEFLATE_FINISH, the call should be repeated (with the rest of the input) until all of it is taken and '*out_len'
+		is less than 'out_cap'.
+*/
+int deflate_compr_push(deflate_compr_t* com, const unsigned char* in, size_t in_len, size_t* in_used, unsigned char* out, size_t out_cap, size_t* out_len, int flush){
+	static const unsigned char none[1]; // 'src' for no input, since NULL means 'fd_in'
+	int ret;
+	int flushed = 0; // bool, the sync flush has been written
+	size_t n;
+	*in_used = *out_len = 0;
+	if (!(ret = fail_checkpoint())){
+		if (!com->started){
+			deflate_write_header(com);
+			com->started = 1;
+		}
+		for (;;){
+			n = min(com->bw.pos - com->out, out_cap - *out_len);
+			if (n){
+				memcpy(out + *out_len, com->bw.buf + com->out, n);
+			}
+			com->out += n;
+			*out_len += n;
+			if (com->out < com->bw.pos){ // out of room for output
+				break;
+			}
+			com->out = com->bw.pos = 0;
+			if (com->stage == PL_DONE){
+				ret = DEFLATE_STREAM_END;
+				break;
+			}
+			if (flushed || (*in_used == in_len && (flush == DEFLATE_NO_FLUSH
+				|| (flush == DEFLATE_SYNC_FLUSH && com->stage == PL_RESTART && !com->fill)))){ // nothing (new) to flush
+				break;
+			}
+			
+			// a sliding window of input at most at a time, so that the output of one comes out before the next is taken
+			n = min(in_len - *in_used, com->sliding_window);
+			com->src = (in)? in + *in_used : none;
+			com->src_len = n;
+			com->wait = (flush == DEFLATE_NO_FLUSH || *in_used + n < in_len);
+			com->last = (flush == DEFLATE_FINISH);
+			com->more = (flush == DEFLATE_SYNC_FLUSH);
+			ret = process_loop(com, &com->cl_htb);
+			*in_used += n - com->src_len;
+			if (!ret){
+				continue;
+			}
+			ret = 0;
+			if (com->last){
+				deflate_write_trailer(com);
+				com->stage = PL_DONE;
+				continue;
+			}
+			
+			// make a fresh start after the sync flush, with the input so far as the sliding window before it
+			bit_writer_align(&com->bw);
+			n = com->bound - com->e;
+			memmove(com->d, com->d + n, com->sliding_window);
+			com->bound = com->e;
+			com->pos += n;
+			com->bt_next = max(com->bt_next, com->pos - com->sliding_window); // the rest of the binary trees stays as it is
+			com->stage = PL_RESTART;
+			com->done = 0;
+			com->i = com->held = com->prev_dist = 0;
+			com->prev_len = 2;
+			flushed = 1;
+		}
+	}
+	fail_uncheckpoint();
+	return ret;
+}
+
+struct deflate_chunk{ // chunk of the input compressed on a worker thread (see deflate_compress_parallel)
+	unsigned char* buf; // the 'dict_len' chars of the input right before the chunk, then the chunk, and room for one char more
+	const unsigned char* src; // the chunk
+	size_t len; // its length
+	size_t dict_len; // number of chars of the input right before it to prime the sliding window with
+	swi sw;
+	int level, strategy, ops;
+	unsigned char last; // bool, the chunk ends the input
+	unsigned char done; // bool, the chunk is compressed (or failed to be)
+	unsigned int adler; // adler32 checksum of the chunk
+	struct string_len out; // raw deflate blocks of the chunk
+	int ret; // 0 or the error
+};
+
+struct deflate_chunk_queue{ // chunks read in by deflate_compress_chunks, and taken in order by its worker threads
+	struct deflate_chunk* chs; // chunk k of the input is chs[k % n_chs] until it is written out
+	int n_chs;
+	size_t queued; // number of chunks read in so far
+	size_t taken; // number of those taken by a worker
+	unsigned char quit; // bool, the workers are to stop
+	pthread_t* workers;
+	int n_workers; // number of them running
+	pthread_mutex_t lock; // over all of the above but 'chs', and the 'done' of each chunk
+	pthread_cond_t work; // a chunk is queued, or the workers are to stop
+	pthread_cond_t done; // a chunk is compressed
+};
+
+// Compress the chunk 'ch' into raw deflate blocks, ending with a sync flush unless it is the last chunk
+static void deflate_chunk_compress(struct deflate_chunk* ch){
+	deflate_compr_t* com;
+	com = spawn_deflate_compr_t();
+	if ((ch->ret = deflate_compr_init(com, -1, -1, -1, ch->sw, ch->level, ch->strategy, ch->ops))){
+		free(com);
+		return;
+	}
+	if (!(ch->ret = fail_checkpoint())){
+		com->src = ch->src;
+		com->src_len = ch->len;
+		com->last = ch->last;
+		if (ch->dict_len){
+			deflate_compr_dict(com, ch->src - ch->dict_len, ch->dict_len);
+		}
+		process_loop(com, &com->cl_htb);
+		bit_writer_align(&com->bw);
+		ch->adler = com->adler;
+		ch->out.str = com->bw.buf;
+		ch->out.len = com->bw.pos;
+		com->bw.buf = NULL; // handed over to 'out'
+	}
+	fail_uncheckpoint();
+	deflate_compr_deinit(com);
+	free(com);
+}
+
+// Compress the chunks of the struct deflate_chunk_queue 'arg' as they are queued, until told to quit
+static void* deflate_chunk_worker(void* arg){
+	struct deflate_chunk_queue* q = arg;
+	struct deflate_chunk* ch;
+	pthread_mutex_lock(&q->lock);
+	for (;;){
+		while (!q->quit && q->taken == q->queued){
+			pthread_cond_wait(&q->work, &q->lock);
+		}
+		if (q->quit){
+			break;
+		}
+		ch = q->chs + q->taken++ % q->n_chs;
+		pthread_mutex_unlock(&q->lock);
+		deflate_chunk_compress(ch);
+		pthread_mutex_lock(&q->lock);
+		ch->done = 1;
+		pthread_cond_signal(&q->done);
+	}
+	pthread_mutex_unlock(&q->lock);
+	return NULL;
+}
+
+// Stop the workers of 'q' and free it
+static void deflate_chunk_queue_free(struct deflate_chunk_queue* q){
+	int i;
+	pthread_mutex_lock(&q->lock);
+	q->quit = 1;
+	pthread_cond_broadcast(&q->work);
+	pthread_mutex_unlock(&q->lock);
+	for (i = 0; i < q->n_workers; i++){
+		pthread_join(q->workers[i], NULL);
+	}
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->work);
+	pthread_cond_destroy(&q->done);
+	for (i = 0; q->chs && i < q->n_chs; i++){
+		free(q->chs[i].buf);
+		free(q->chs[i].out.str);
+	}
+	free(q->chs);
+	free(q->workers);
+	free(q);
+}
+
+// Write the 'len' bytes at 'p' to 'fd'
+static void write_out(int fd, const unsigned char* p, size_t len){
+	ssize_t ret;
+	for (; len > 0; p += ret, len -= ret){
+		if ((ret = write(fd, p, len)) <= 0){
+			fail_out(E_WRITE);
+		}
+	}
+}
+
+// Write 'x' to 'p' as 'n' bytes, most significant first
+static void put_be(unsigned char* p, unsigned long long x, int n){
+	for (; n > 0; n--){
+		*p++ = x >> (8 * (n - 1));
+	}
+}
+
+/* Writes the seek table of a stream from deflate_compress_seekable to 'fd', after its adler32 trailer
+	The table is a big endian 8 byte (compressed, decompressed) offset pair for every seek point of 'seek', then the length
+		of the decompressed data in 8 bytes, the number of seek points in 4, and DEFLATE_SEEK_MAGIC in 4.
+*/
+static void write_seek_table(int fd, const struct deflate_index* seek){
+	unsigned char bytes[16];
+	unsigned int i;
+	for (i = 0; i < seek->n; i++){
+		put_be(bytes, seek->points[i].in, 8);
+		put_be(bytes + 8, seek->points[i].out, 8);
+		write_out(fd, bytes, 16);
+	}
+	put_be(bytes, seek->len, 8);
+	put_be(bytes + 8, seek->n, 4);
+	put_be(bytes + 12, DEFLATE_SEEK_MAGIC, 4);
+	write_out(fd, bytes, 16);
+}
+
+// Add a seek point to 'seek' at byte 'in' of the compressed data, with 'out' bytes of input before it
+static void seek_point_add(struct deflate_index* seek, size_t in, size_t out){
+	struct deflate_point* pt;
+	if (a_list_add((void**)&seek->points, &seek->n, sizeof(struct deflate_point))){
+		fail_out(E_MALLOC);
+	}
+	pt = seek->points + seek->n - 1;
+	pt->in = in;
+	pt->out = out;
+}
+
+/* Compresses the input in chunks of 'chunk_sz' bytes on 'threads' worker threads, for deflate_compress_parallel and
+	deflate_compress_seekable; the chunks are primed with the input before them, unless 'seek' is given, in which case
+	they start over and a seek point for each of them is added to 'seek'
+	The chunks are read into a ring of twice as many as there are workers, which take them in order as soon as they are
+		read in. The oldest is written out as soon as it is compressed, and its place taken by the next chunk of the input,
+		so reading and writing overlap with compression, and no worker waits on another's chunk.
+*/
+static int deflate_compress_chunks(int fd_in, int fd_out, swi sw, int level, int strategy, int ops, int threads, size_t chunk_sz, struct deflate_index* seek){
+	int ret, i, ahead = 0; // 'ahead' is whether a char was read in past the latest chunk (so the input goes on)
+	size_t total = 0, len, dict_len, in = 2, out = 0, n_read = 0, n_written = 0; // 'in' and 'out' are the lengths of the output and input so far
+	ssize_t r;
+	unsigned int adler = 1, head;
+	unsigned char bytes[4];
+	struct deflate_chunk_queue* volatile q = NULL; // volatile, as it is set after the checkpoint and freed after a failure
+	struct deflate_chunk* ch, * prev = NULL;
+	if (!chunk_sz){
+		chunk_sz = DEFLATE_CHUNK_SZ;
+	}
+	if (!(ret = fail_checkpoint())){
+		deflate_params_check(sw, level, strategy);
+		if (threads < 1){
+			fail_out(E_RANGE);
+		}
+		deflate_tables_init(); // before the threads, which would all fill in the tables at once
+		hist_tables_init();
+		if (!(q = calloc(1, sizeof(struct deflate_chunk_queue)))){
+			fail_out(E_MALLOC);
+		}
+		pthread_mutex_init(&q->lock, NULL);
+		pthread_cond_init(&q->work, NULL);
+		pthread_cond_init(&q->done, NULL);
+		q->n_chs = 2 * threads;
+		if (!(q->chs = calloc(q->n_chs, sizeof(struct deflate_chunk))) || !(q->workers = malloc(threads * sizeof(pthread_t)))){
+			fail_out(E_MALLOC);
+		}
+		for (i = 0; i < q->n_chs; i++){
+			if (!(q->chs[i].buf = malloc(sw + chunk_sz + 1))){
+				fail_out(E_MALLOC);
+			}
+		}
+		for (i = 0; i < threads; i++){
+			if (pthread_create(q->workers + q->n_workers, NULL, deflate_chunk_worker, q)){
+				break; // make do with fewer, or none, in which case the chunks are compressed right here
+			}
+			q->n_workers++;
+		}
+		head = deflate_header(sw, level, 0);
+		bytes[0] = head & 0xff;
+		bytes[1] = head >> 8;
+		write_out(fd_out, bytes, 2);
+		do{
+			for (; n_read - n_written < q->n_chs && (ahead || !n_read); n_read++){ // read chunks into the free places
+				ch = q->chs + n_read % q->n_chs;
+				dict_len = (seek)? 0 : min(sw, total);
+				if (dict_len){ // the end of the chunk before (being compressed, but only ever read from)
+					memcpy(ch->buf, prev->buf + prev->dict_len + prev->len - dict_len, dict_len);
+				}
+				if ((len = ahead)){ // the char read in past it
+					ch->buf[dict_len] = prev->buf[prev->dict_len + prev->len];
+				}
+				for (; len < chunk_sz + 1; len += r){ // the chunk, and one char more
+					if ((r = read(fd_in, ch->buf + dict_len + len, chunk_sz + 1 - len)) < 0){
+						fail_out(E_READ);
+					}
+					if (!r){
+						break;
+					}
+				}
+				ahead = len > chunk_sz;
+				if (!(len -= ahead)){ // no input at all
+					break;
+				}
+				ch->src = ch->buf + dict_len;
+				ch->len = len;
+				ch->dict_len = dict_len;
+				ch->sw = sw;
+				ch->level = level;
+				ch->strategy = strategy;
+				ch->ops = ops;
+				ch->last = !ahead;
+				ch->done = 0;
+				total += len;
+				prev = ch;
+				if (!q->n_workers){
+					deflate_chunk_compress(ch);
+					ch->done = 1;
+				}
+				pthread_mutex_lock(&q->lock);
+				q->queued++;
+				pthread_cond_signal(&q->work);
+				pthread_mutex_unlock(&q->lock);
+			}
+			if (n_written == n_read){ // no input at all
+				if (seek){ // still a seek point, at the empty block, so that the empty range can be extracted
+					seek_point_add(seek, in, out);
+				}
+				bytes[0] = 0x03; // BFINAL = 1, BTYPE = 01, and the end of block code (0000000)
+				bytes[1] = 0x00;
+				write_out(fd_out, bytes, 2);
+				break;
+			}
+			ch = q->chs + n_written % q->n_chs; // the oldest, once it is compressed
+			pthread_mutex_lock(&q->lock);
+			while (!ch->done){
+				pthread_cond_wait(&q->done, &q->lock);
+			}
+			pthread_mutex_unlock(&q->lock);
+			if (ch->ret){
+				fail_out(ch->ret);
+			}
+			if (seek){
+				seek_point_add(seek, in, out);
+			}
+			write_out(fd_out, ch->out.str, ch->out.len);
+			in += ch->out.len;
+			out += ch->len;
+			freec(ch->out.str);
+			adler = adler32_combine(adler, ch->adler, ch->len);
+		} while (++n_written < n_read || ahead);
+		put_be(bytes, adler, 4);
+		write_out(fd_out, bytes, 4);
+		if (seek){
+			seek->len = out;
+			seek->sliding_window = sw;
+			write_seek_table(fd_out, seek);
+		}
+	}
+	fail_uncheckpoint();
+	if (q){
+		deflate_chunk_queue_free(q);
+	}
+	return ret;
+}
+
+/* Performs deflate compression as deflate_compress does (without 'fd_stats'), on up to 'threads' threads at once (after pigz)
+	The input is split into chunks of 'chunk_sz' bytes (DEFLATE_CHUNK_SZ if 0), each compressed on a thread of its own with
+		the 'sw' chars of the input before it as a preset dictionary, so that dup strings still reach back across chunks.
+		Every chunk but the last ends with a sync flush, which leaves it at a byte boundary, so the chunks simply follow one
+		another in the output, and their adler32 checksums are combined into the one of the whole input.
+	Each chunk is read in along with one char past it, which tells whether it ends the input. What a chunk compresses to
+		only depends on the chunk, the 'sw' chars before it, and whether it is the last, so the output is the same for any
+		number of threads.
+*/
+int deflate_compress_parallel(int fd_in, int fd_out, swi sw, int level, int strategy, int ops, int threads, size_t chunk_sz){
+	return deflate_compress_chunks(fd_in, fd_out, sw, level, strategy, ops, threads, chunk_sz, NULL);
+}
+
+/* Performs deflate compression as deflate_compress_parallel does, but with a full flush every 'span' bytes of input
+	(DEFLATE_CHUNK_SZ if 0): the sliding window starts over after each one, so that decompression can start there too.
+	The zlib data is followed by a seek table (see write_seek_table) that zlib decompressors leave alone as trailing data,
+		and that deflate_seekable_index reads back into a struct deflate_index for deflate_index_extract.
+*/
+int deflate_compress_seekable(int fd_in, int fd_out, swi sw, int level, int strategy, int ops, int threads, size_t span){
+	struct deflate_index seek = {NULL, 0, 0, 0};
+	int ret;
+	ret = deflate_compress_chunks(fd_in, fd_out, sw, level, strategy, ops, threads, span, &seek);
+	free(seek.points);
+	return ret;
+}
+
+// Returns the most output deflate_compress_buffer can write for 'len' bytes of input: the zlib stream of stored blocks
+size_t deflate_compress_bound(size_t len){
+	return 2 + len + 5 * (len / 0xffff + (len % 0xffff || !len)) + 4;
+}
+
+/* Performs deflate compression of the 'len' bytes at 'src' into the 'cap' bytes at 'dst' as deflate_compress does (with a
+	32 KiB sliding window), setting '*dst_len' to the length of the zlib data
+	Dup strings are searched for in 'src' itself rather than in a copy of it in the sliding window; only the last window
+		or so is copied, since searching may read a little past the input (see dup_str_len and deflate_compr_src).
+	The output is written straight into 'dst' (see bit_writer_init_buf). If it comes out longer than the input in stored
+		blocks would be, or runs out of room, the stored blocks are written instead, so it never takes more than
+		deflate_compress_bound(len) bytes. Fails with E_SZ if 'cap' is not enough.
+*/
+int deflate_compress_buffer(const unsigned char* src, size_t len, unsigned char* dst, size_t cap, size_t* dst_len, int level){
+	int ret;
+	size_t n, i, blk;
+	unsigned int head;
+	deflate_compr_t* com;
+	com = spawn_deflate_compr_t();
+	memset(com, 0, sizeof(*com)); // all NULL, so that deflate_compr_deinit frees just what was allocated before a failure
+	if (!(ret = fail_checkpoint())){
+		deflate_compr_setup(com, -1, -1, -1, 1 << 15, level, DEFLATE_DEFAULT, 0, dst, cap);
+		deflate_compr_src(com, src, len);
+		deflate_write_header(com);
+		process_loop(com, &com->cl_htb);
+		deflate_write_trailer(com);
+		*dst_len = com->bw.pos;
+	}
+	fail_uncheckpoint();
+	n = deflate_compress_bound(len);
+	if ((ret == E_SZ || (!ret && *dst_len > n)) && n <= cap){ // stored blocks instead (rfc1951 3.2.4), after the same header
+		head = deflate_header(1 << 15, level, 0);
+		dst[0] = head & 0xff;
+		dst[1] = head >> 8;
+		i = 0;
+		n = 2;
+		do{
+			blk = min(len - i, 0xffff);
+			dst[n] = (i + blk == len); // BFINAL, BTYPE = 00
+			dst[n + 1] = blk & 0xff; // LEN, least significant byte first
+			dst[n + 2] = blk >> 8;
+			dst[n + 3] = ~blk & 0xff; // NLEN
+			dst[n + 4] = (~blk >> 8) & 0xff;
+			if (blk){ // 'src' may be NULL with no input
+				memcpy(dst + n + 5, src + i, blk);
+			}
+			n += 5 + blk;
+			i += blk;
+		} while (i < len);
+		put_be(dst + n, adler32_update(1, src, len), 4);
+		*dst_len = n + 4;
+		ret = 0;
+	}
+	deflate_compr_deinit(com);
+	free(com);
+	return ret;
+}
+
+struct dict_seg{ // segment of the samples picked for a trained dictionary
+	const unsigned char* str;
+	unsigned int score;
+};
+
+static int dict_seg_cmp(const void* a, const void* b){ // for qsort; lowest score first
+	unsigned int x = ((const struct dict_seg*)a)->score, y = ((const struct dict_seg*)b)->score;
+	return (x > y) - (x < y);
+}
+
+/* Trains a preset dictionary of at most 'cap' (up to 32768) chars on the 'n' sample messages 'samples', for small inputs like them
+	Every string of three chars is scored by the number of samples it is in, keyed by dup_hash as in the hash chains, since a
+		dup string into the dictionary pays off for every message that has it. The samples (end to end) are divided into
+		'cap' / 'seg' epochs, and the 'seg' chars of each epoch whose distinct hashes have the highest total score are picked
+		(after COVER in zstd). The hashes of a picked segment score nothing from then on, so the dictionary does not hold the
+		same strings twice. 'seg' is the mean length of the samples (within DEFLATE_DICT_SEG_MIN and DEFLATE_DICT_SEG_MAX),
+		since a segment that long holds whole messages' worth of structure without crowding out the rest.
+	The segments are laid out from lowest to highest score, so that the most useful ones are the nearest (see
+		deflate_compr_dict) and the last to slide out.
+	'dict' is set to the dictionary, which must be freed; returns 0 or the error
+*/
+int deflate_dict_train(struct string_len* dict, const struct string_len* samples, int n, size_t cap){
+	int ret, i, n_segs = 0;
+	unsigned int h, score, best_score;
+	unsigned int* freq = NULL; // number of samples each hash is in
+	int* seen = NULL; // the last sample each hash was counted for
+	unsigned short* cnt = NULL; // number of times each hash is in the segment being scored
+	unsigned char* all = NULL; // the samples end to end
+	struct dict_seg* segs = NULL;
+	size_t total = 0, seg, epochs, epoch_len, e, s, t, q, p, best;
+	dict->str = NULL;
+	dict->len = 0;
+	if (!(ret = fail_checkpoint())){
+		if (cap == 0 || cap > 1 << 15 || n < 0){
+			fail_out(E_RANGE);
+		}
+		for (i = 0; i < n; i++){
+			total += samples[i].len;
+		}
+		if (!(freq = calloc(DUP_HT_SZ, sizeof(unsigned int))) || !(seen = malloc(DUP_HT_SZ * sizeof(int)))
+			|| !(cnt = malloc(DUP_HT_SZ * sizeof(unsigned short))) || !(all = malloc(total + 1))){
+			fail_out(E_MALLOC);
+		}
+		memset(seen, -1, DUP_HT_SZ * sizeof(int));
+		for (i = 0, p = 0; i < n; p += samples[i++].len){
+			memcpy(all + p, samples[i].str, samples[i].len);
+			for (q = 0; q + 3 <= samples[i].len; q++){ // count each hash once per sample
+				h = dup_hash(samples[i].str + q);
+				if (seen[h] != i){
+					seen[h] = i;
+					freq[h]++;
+				}
+			}
+		}
+		seg = (n)? min(max(total / n, DEFLATE_DICT_SEG_MIN), DEFLATE_DICT_SEG_MAX) : 0;
+		seg = min(seg, min(total, cap));
+		epochs = max(min(total, cap) / max(seg, 1), 1);
+		epoch_len = total / epochs;
+		if (!(segs = malloc(epochs * sizeof(struct dict_seg)))){
+			fail_out(E_MALLOC);
+		}
+		for (e = 0; seg >= 3 && e < epochs; e++){ // pick the best segment of each epoch
+			s = e * epoch_len;
+			t = (e == epochs - 1)? total : s + epoch_len;
+			memset(cnt, 0, DUP_HT_SZ * sizeof(unsigned short));
+			score = best_score = 0;
+			best = s;
+			for (p = s; p + 2 < s + seg; p++){ // the first segment
+				if (!cnt[h = dup_hash(all + p)]++){
+					score += freq[h];
+				}
+			}
+			for (q = s;; q++){ // the segment at q has the hashes from q through q + seg - 3
+				if (score > best_score){
+					best_score = score;
+					best = q;
+				}
+				if (q + seg >= t){
+					break;
+				}
+				if (!--cnt[h = dup_hash(all + q)]){
+					score -= freq[h];
+				}
+				if (!cnt[h = dup_hash(all + q + seg - 2)]++){
+					score += freq[h];
+				}
+			}
+			if (best_score){
+				segs[n_segs].str = all + best;
+				segs[n_segs++].score = best_score;
+				for (p = best; p + 2 < best + seg; p++){
+					freq[dup_hash(all + p)] = 0;
+				}
+			}
+		}
+		qsort(segs, n_segs, sizeof(struct dict_seg), dict_seg_cmp);
+		if (!(dict->str = malloc(max(n_segs * seg, 1)))){
+			fail_out(E_MALLOC);
+		}
+		for (i = 0; i < n_segs; i++){
+			memcpy(dict->str + dict->len, segs[i].str, seg);
+			dict->len += seg;
+		}
+	}
+	fail_uncheckpoint();
+	if (ret){
+		freec(dict->str);
+		dict->len = 0;
+	}
+	free(freq);
+	free(seen);
+	free(cnt);
+	free(all);
+	free(segs);
+	return ret;
 }
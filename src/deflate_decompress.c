@@ -2,16 +2,24 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
 #include "include/globals.h"
 #include "include/deflate.h"
-#include "include/errors.h"
+#include "include/deflate_ext.h"
+#include "include/deflate_errors.h"
+#include "include/h_tree.h"
+#include "include/adler32.h"
 
 #define DEFLATE_DECOMP_INIT_SZ (256 * sizeof(unsigned char))
 
 struct deflate_decompr{ // amortized list
 	unsigned char* d;
 	size_t sz;
+	size_t cap; // capacity of 'd'
+	size_t start; // where the output starts in 'd'; a preset dictionary comes before it
 	size_t sliding_window; // obtained from header; used to verify dists aren't too large
+	unsigned char* end; // end of the compressed blocks (start of the adler32 checksum)
+	struct h_tree_head h1, h2, h3; // code length, literal/length, and distance Huffman trees of the current block
 };
 
 struct code_len{
@@ -19,8 +27,8 @@ struct code_len{
 	short len;
 };
 
-// See 3.2.7, HCLEN
-const unsigned char D1_INIT_CODE_LENS[] = {16, 0, 17, 0, 18, 0, 0, 0, 8, 0, 7, 0, 9, 0, 6, 0, 10, 0, 5, 0, 11, 0, 4, 0, 12, 0, 3, 0, 13, 0, 2, 0, 14, 0, 1, 0, 15, 0};
+// Order in which the code length code lengths are read (3.2.7)
+static const unsigned char CL_ORDER[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
 
 int code_len_cmp(const void* a, const void* b){ // for qsort
 	// sort by len, then by val
@@ -31,40 +39,68 @@ int code_len_cmp(const void* a, const void* b){ // for qsort
 	return ret;
 }
 
+// Set up 'dec' with an empty output and no Huffman trees; nothing is allocated until the output is written to
+static void decompr_init(struct deflate_decompr* dec){
+	dec->d = NULL;
+	dec->sz = dec->cap = dec->start = 0;
+	dec->h1.tree = dec->h2.tree = dec->h3.tree = NULL;
+}
+
+// Free whatever 'dec' still holds
+static void decompr_deinit(struct deflate_decompr* dec){
+	freec(dec->d);
+	h_tree_deinit(&dec->h1);
+	h_tree_deinit(&dec->h2);
+	h_tree_deinit(&dec->h3);
+}
+
+// Make room for 'len' more characters in the 'dec' amortized list
+static void decompr_reserve(struct deflate_decompr* dec, size_t len){
+	size_t cap = max(dec->cap, DEFLATE_DECOMP_INIT_SZ);
+	if (dec->sz + len <= dec->cap)
+		return;
+	while (cap < dec->sz + len)
+		cap <<= 1;
+	if ((dec->d = realloc(dec->d, cap)) == NULL)
+		fail_out(E_MALLOC);
+	dec->cap = cap;
+}
+
 // Write a single character to the 'dec' amortized list
-int decompr_write_char(struct deflate_decompr* dec, unsigned char c){
-	int ret = 0;
-	if (!(dec->sz & (dec->sz - 1))){
-		if ((dec->d = realloc(dec->d, dec->sz << 1)) == NULL)
-			fail_out(E_MALLOC);
-	}
+void decompr_write_char(struct deflate_decompr* dec, unsigned char c){
+	decompr_reserve(dec, 1);
 	dec->d[dec->sz++] = c;
-fail:
-	return ret;
 }
 
-// Write the character sequence 'str' of length 'len' to the 'dec' amortized list
-int decompr_write_str(struct deflate_decompr* dec, const unsigned char* str, unsigned int len){
-	int ret = 0;
-	if ((dec->d = realloc(dec->d, 1ULL << __builtin_clzl(dec->sz - 1 + len))) == NULL)
-		fail_out(E_MALLOC);
-	// copy chars
-	while (len-- > 0){
-		dec->d[dec->sz++] = *(str++);
-	}
-fail:
-	return ret;
+// Write the character sequence 'str' of length 'len' to the 'dec' amortized list; 'str' must not be within the list
+void decompr_write_str(struct deflate_decompr* dec, const unsigned char* str, unsigned int len){
+	decompr_reserve(dec, len);
+	memcpy(dec->d + dec->sz, str, len);
+	dec->sz += len;
 }
 
-// Compute the adler32 checksum of the memory segment at 'b' of length 'len'
-unsigned int adler32(const unsigned char* b, size_t len){
-	unsigned int s1 = 1, s2 = 0;
-	size_t i;
-	for (i = 0; i < len; i++){
-		s1 = (s1 + b[i]) % 65521;
-		s2 = (s2 + s1) % 65521;
+// Write the 'len' characters starting 'dist' back to the 'dec' amortized list; they may overlap the ones being written
+void decompr_write_dup(struct deflate_decompr* dec, unsigned int dist, unsigned int len){
+	unsigned char* p, * q;
+	decompr_reserve(dec, len);
+	p = dec->d + dec->sz;
+	q = p - dist;
+	dec->sz += len;
+	if (dist >= len){
+		memcpy(p, q, len);
+	}
+	else{
+		while (len-- > 0){
+			*(p++) = *(q++);
+		}
 	}
-	return (s2 << 16) | s1;
+}
+
+// Fail out if no bits may be read at '*byte'
+	// Bits are only ever read a symbol or so past where this is checked, which stays within the adler32 checksum after 'end'
+static inline void decompr_check_bounds(const struct deflate_decompr* dec, unsigned char* const* byte){
+	if (*byte >= dec->end)
+		fail_out(E_ZBSZ);
 }
 
 // Look up the Huffman code value from the fixed literal/length Huffman tree
@@ -87,7 +123,7 @@ int h_tree_lookup_fl(unsigned char** byte, int* bit){
 		else{ // lit values 144-255: codes 110010000 to 111111111
 			b <<= 1;
 			b |= read_bits32(byte, bit, 1);
-			adjust -256;
+			adjust = -256;
 		}
 	}
 	return b + adjust;
@@ -145,265 +181,1111 @@ int _h_tree_lookup(const struct h_tree_head* h, unsigned char** byte, int* bit){
 
 void form_h_tree(struct h_tree_head* h, struct code_len* cls){
 	// 3.2.2 procedure
-	int i, start, prev_len_count = 0;
+	int i, start, prev_len = 0;
 	h_code code = 0;
 	// cls is already sorted by len and has terminating entry (with len > MAX_CODE_LEN); skip over zeros (aren't to be represented in tree)
-	for (i = 0; cls[i].len == 0; i++); // FUTURE: realloc away unused (zero len) entries?
+	for (i = 0; cls[i].len == 0; i++);
 	while (cls[i].len <= MAX_CODE_LEN){ // while not at last entry in 'cls' array
 		start = i;
-		code = (code + prev_len_count) << 1; // begin at the next length, incrementing the old prefix
-		for (; cls[i].len == cls[start].len; i++){ // loop through the entries with this length
-			// continue to increment the code being added (code + i - start)
-			h_tree_add(h, code + i - start, cls[start].len, cls[i].val);
+		code <<= cls[start].len - prev_len; // begin at the next length, incrementing the old prefix
+		for (; cls[i].len == cls[start].len; i++, code++){ // loop through the entries with this length
+			h_tree_add(h, code, cls[i].len, cls[i].val);
+		}
+		prev_len = cls[start].len;
+	}
+}
+
+// Fail out unless the first 'n' code lengths of 'cls' make a complete prefix code (3.2.2), as zlib requires
+	// 'lone' allows an incomplete code of a single code of length 1, or none at all, as for the literal/length and distance codes
+static void check_code_lens(const struct code_len* cls, int n, int lone){
+	unsigned int sum = 0;
+	int i, top = 0;
+	for (i = 0; i < n; i++){
+		if (cls[i].len){
+			sum += 1U << (15 - cls[i].len); // code lengths are at most 15
+			top = max(top, cls[i].len);
 		}
-		prev_len_count = i - start; // update the number of codes with the previous length
 	}
+	if (sum > 1U << 15 || (sum < 1U << 15 && !(lone && top <= 1)))
+		fail_out(E_HUFINV);
 }
 
 // Create the dynamic Huffman tree for the code length alphabet
-void form_d1(struct h_tree_head* h, unsigned char** byte, int* bit, int hclen){
-	struct code_len cls[hclen + 1];
+void form_d1(struct deflate_decompr* dec, unsigned char** byte, int* bit, int hclen){
+	struct code_len cls[19 + 1];
 	int i;
-	memcpy(cls, D1_INIT_CODE_LENS, (hclen + 1) * sizeof(struct code_len));
-	h_tree_init(h, hclen);
-	
+	h_tree_init(&dec->h1, 19);
+
 	// read the code lengths for the code length alphabet; each is 3 bits and there are 'hclen' of them
-	for (i = 0; i < hclen; i++){
-		cls[i].len = read_bits32(byte, bit, 3);
+	for (i = 0; i < 19; i++){
+		cls[i].val = CL_ORDER[i];
+		if (i < hclen){
+			decompr_check_bounds(dec, byte);
+			cls[i].len = read_bits32(byte, bit, 3);
+		}
+		else{
+			cls[i].len = 0;
+		}
 	}
-	cls[hclen].len = MAX_CODE_LEN + 1;
-	qsort(cls, hclen, sizeof(struct code_len), code_len_cmp);
-	form_h_tree(h, cls);
+	check_code_lens(cls, 19, 0);
+	cls[19].len = MAX_CODE_LEN + 1;
+	qsort(cls, 19, sizeof(struct code_len), code_len_cmp);
+	form_h_tree(&dec->h1, cls);
 }
 
 // Create the dynamic Huffman tree for the literal/length (h2) and distance (h3) alphabets
-int form_d2(const struct h_tree_head* h1, struct h_tree_head* h2, struct h_tree_head* h3, unsigned char** byte, int* bit, int hlit, int hdist){
-	int ret = 0, i, cl, top, val;
-	struct code_len* cls;
-	unsigned int b = 0; // number of code length entries in a row to set to this code length
-	if ((cls = malloc((hlit + 1) * sizeof(struct code_len))) == NULL) // also sufficient for h3 since hlit > hdist, always
-		fail_out(E_MALLOC);
-	h_tree_init(h2, hlit);
-	h_tree_init(h3, hdist);
-	cl = -1;
-	// 3.2.7 code length procedure
-	top = hlit; // static upper bound for code length entries
-form_d2_1:
-	for (i = val = 0; i < top;){
-		ret = _h_tree_lookup(h1, byte, bit); // read from the code length Huffman tree (0 - 18)
+void form_d2(struct deflate_decompr* dec, unsigned char** byte, int* bit, int hlit, int hdist){
+	struct code_len cls[NUM_LITLEN_CODES + NUM_DIST_CODES + 1];
+	int i, cl = -1, b, ret;
+	h_tree_init(&dec->h2, hlit);
+	h_tree_init(&dec->h3, hdist);
+	// 3.2.7 code length procedure; the literal/length and distance code lengths are one sequence, which runs may span
+	for (i = 0; i < hlit + hdist;){
+		decompr_check_bounds(dec, byte);
+		ret = _h_tree_lookup(&dec->h1, byte, bit); // read from the code length Huffman tree (0 - 18)
 		if (ret < 16){ // < 16; literal code length
 			cl = ret;
 			b = 1;
 		}
-		else{
-			if (ret == 16){ // == 16; copy this code length 3 - 6 times depending on next 2 bits
-				if (cl < 0) // no current code length
-					fail_out(E_HUFINV);
-				b = read_bits32(byte, bit, 2) + 3;
-			}
-			else if (ret == 17){ // == 17; repeat code length 0 3 - 10 times depending on next 3 bits
-				cl = 0;
-				b = read_bits32(byte, bit, 3) + 3;
-			}
-			else if (ret == 18){ // == 18; repeat code length 0 11 - 138 times depending on next 7 bits
-				cl = 0;
-				b = read_bits32(byte, bit, 7) + 11;
-			}
-			else
-				fail_out(E_HUFVAL);
+		else if (ret == 16){ // == 16; copy this code length 3 - 6 times depending on next 2 bits
+			if (cl < 0) // no current code length
+				fail_out(E_HUFINV);
+			b = read_bits32(byte, bit, 2) + 3;
+		}
+		else if (ret == 17){ // == 17; repeat code length 0 3 - 10 times depending on next 3 bits
+			cl = 0;
+			b = read_bits32(byte, bit, 3) + 3;
 		}
-form_d2_2:
-		for (; b > 0 && i < top; b--, val++, i++){ // set the code length to the 'b' consecutive entries
-			cls[i].val = val;
+		else if (ret == 18){ // == 18; repeat code length 0 11 - 138 times depending on next 7 bits
+			cl = 0;
+			b = read_bits32(byte, bit, 7) + 11;
+		}
+		else
+			fail_out(E_HUFVAL);
+		if (i + b > hlit + hdist)
+			fail_out(E_HUFINV);
+		for (; b > 0; b--, i++){ // set the code length to the 'b' consecutive entries
+			cls[i].val = (i < hlit)? i : i - hlit;
 			cls[i].len = cl;
 		}
 	}
-	cls[top].len = MAX_CODE_LEN + 1; // indicates end of the array
-	qsort(cls, top, sizeof(struct code_len), code_len_cmp);
-	if (top == hlit){
-		form_h_tree(h2, cls); // create the literal/length Huffman tree
-		top = hdist;
-		if (b == 0) // build h3 code length array; don't reset 'cl' since the current code length "carries over"
-			goto form_d2_1;
-		else{ // rle extends beyond hlit; reset but continue filling in with this code length
-			i = val = 0;
-			goto form_d2_2;
-		}
+	if (!cls[256].len) // no end of block code
+		fail_out(E_HUFINV);
+	check_code_lens(cls, hlit, 1);
+	check_code_lens(cls + hlit, hdist, 1);
+
+	// create the literal/length Huffman tree from the first 'hlit' code lengths
+	qsort(cls, hlit, sizeof(struct code_len), code_len_cmp);
+	ret = cls[hlit].len; // the first distance code length, moved aside for the terminating entry
+	cls[hlit].len = MAX_CODE_LEN + 1;
+	form_h_tree(&dec->h2, cls);
+	cls[hlit].len = ret;
+
+	// create the distance Huffman tree from the rest
+	qsort(cls + hlit, hdist, sizeof(struct code_len), code_len_cmp);
+	cls[hlit + hdist].len = MAX_CODE_LEN + 1;
+	form_h_tree(&dec->h3, cls + hlit);
+}
+
+// Read the length of a len/dist pair with the literal/length code value 'ret' (257 - 285)
+	// "Code" and "Extra Bits" to "Length" in 3.2.5 Table 1
+static inline int read_len(int ret, unsigned char** byte, int* bit){
+	int len;
+	if (ret < 265)
+		return ret - 254; // no extra bits
+	if (ret == 285)
+		return 258; // no extra bits
+	len = (ret - 261) / 4;
+	return (1 << (len + 2)) + 3 // starting length of this extra bits group
+		+ ((ret - 261) % 4) * (1 << len) // offset to starting length of x in this group
+		+ read_bits32(byte, bit, len); // offset into range of lengths of this x given by bits
+}
+
+// Read the distance of a len/dist pair with the distance Huffman tree 'h3', checking it against the sliding window of 'dec'
+	// "Code" and "Extra Bits" to "Distance" in 3.2.5 Table 2
+static inline int read_dist(const struct deflate_decompr* dec, const struct h_tree_head* h3, unsigned char** byte, int* bit){
+	int ret, dist;
+	decompr_check_bounds(dec, byte);
+	ret = _h_tree_lookup(h3, byte, bit);
+	if (ret < 4)
+		dist = ret + 1; // no extra bits
+	else if (ret < 30){
+		dist = (ret - 2) / 2;
+		dist = (1 << (dist + 1)) + 1 // starting distance of this extra bits group
+			 + (ret % 2) * (1 << dist) // offset to starting distance of x in this group
+			 + read_bits32(byte, bit, dist); // offset into range of distances of this x given by bits
 	}
-	form_h_tree(h3, cls); // create the distance Huffman tree
-	free(cls);
+	else
+		fail_out(E_HUFINV);
+	if (dist > dec->sliding_window)
+		fail_out(E_HUFDIS);
+	return dist;
 }
 
 // Read the compressed data and decompress it using the Huffman trees
-int do_decompress(struct deflate_decompr* dec, const struct h_tree_head* h2, const struct h_tree_head* h3, unsigned char** byte, int* bit){
+void do_decompress(struct deflate_decompr* dec, const struct h_tree_head* h2, const struct h_tree_head* h3, unsigned char** byte, int* bit){
 	// continue 3.2.3 procedure after compression mode resolved
-	int ret = 0, len, dist;
+	int ret, len, dist;
 	for (;;){
+		decompr_check_bounds(dec, byte);
 		ret = _h_tree_lookup(h2, byte, bit);
-		if (ret < 0)
-			goto fail;
 		if (ret == 256) // end of block symbol
 			break;
-		if (ret < 256) // literal byte
-			if ((ret = decompr_write_char(dec, (unsigned char)ret)) < 0)
-				goto fail; // really pass
+		if (ret < 256){ // literal byte
+			decompr_write_char(dec, (unsigned char)ret);
+		}
 		else if (ret < 286){ // len/dist pairs
-			// "Code" and "Extra Bits" to "Length" in 3.2.5 Table 1
-			if (ret < 265)
-				len = ret - 254; // no extra bits
-			else if (ret < 285){
-				len = (ret - 261) / 4;
-				len = (1 << len + 2) + 3 // starting length of this extra bits group
-					+ ((ret - 261) % 4) * (1 << len) // offset to starting length of x in this group
-					+ read_bits32(byte, bit, len); // offset into range of lengths of this x given by bits
-			}
-			else if (ret == 285)
-				len = 258; // no extra bits
-			else
-				fail_out(E_HUFINV);
-			// "Code" and "Extra Bits" to "Distance" in 3.2.5 Table 2
-			ret = _h_tree_lookup(h3, byte, bit);
-			if (ret < 0)
-				goto fail;
-			if (ret < 4)
-				dist = ret + 1; // no extra bits
-			else if (ret < 30){
-				dist = (ret - 2) / 2;
-				dist = (1 << dist + 1) + 1 // starting distance of this extra bits group
-					 + (ret % 2) * (1 << dist) // offset to starting distance of x in this group
-					 + read_bits32(byte, bit, dist); // offset into range of distances of this x given by bits
-			}
-			else
-				fail_out(E_HUFINV);
-			if (dist > dec->sz || dist > dec->sliding_window)
+			len = read_len(ret, byte, bit);
+			dist = read_dist(dec, h3, byte, bit);
+			if (dist > dec->sz)
 				fail_out(E_HUFDIS);
-			if ((ret = decompr_write_str(dec, dec->d + dec->sz - dist, len)) < 0)
-				goto fail;
+			decompr_write_dup(dec, dist, len);
 		}
 		else
 			fail_out(E_HUFVAL);
 	}
-fail:
-	return ret;
 }
 
-// Decompress a deflate block into dec.d starting at bit *bit of *byte and not exceeding rm bytes
-int deflate_block(struct deflate_decompr* dec, unsigned char** byte, int* bit, size_t rm){
+// Read the header of a dynamic Huffman block after BTYPE (3.2.7) into the Huffman trees of 'dec'
+static void read_dynamic_trees(struct deflate_decompr* dec, unsigned char** byte, int* bit){
+	unsigned int i, hlit, hdist, hclen;
+	i = read_bits32(byte, bit, 14);
+	hlit = MASK(i, 0, 5) + 257;
+	hdist = MASK(i, 5, 10) + 1;
+	hclen = MASK(i, 10, 14) + 4;
+	if (hlit > 286 || hdist > 30)
+		fail_out(E_ZINV); // others fine due to capping at #bit max
+	form_d1(dec, byte, bit, hclen);
+	form_d2(dec, byte, bit, hlit, hdist);
+}
+
+// Decompress a deflate block into dec.d starting at bit *bit of *byte; returns 1 if it is the final block
+int deflate_block(struct deflate_decompr* dec, unsigned char** byte, int* bit){
 	// continuing 3.2.3 procedure at line 2
-	int ret = 0, i, bfinal, btype;
-	unsigned char* orig_byte; // save the original byte pointer
+	int ret = 0, bfinal, btype;
 	unsigned short len, nlen; // length, 1's complement length
-	unsigned int hlit, hdist, hclen;
-	struct h_tree_head h1, h2, h3;
-	orig_byte = *byte;
-	if (read_bits32(byte, bit, 1)) // BFINAL means this is the last block
-		bfinal = 1;
+	struct h_tree_head fl, fd;
+	decompr_check_bounds(dec, byte);
+	bfinal = read_bits32(byte, bit, 1); // BFINAL means this is the last block
 	btype = read_bits32(byte, bit, 2);
 	switch (btype){ // BTYPE is the type of the block
 		case 0: // uncompressed
 			byte_roundup(*byte, *bit);
-			if (byte + 4 - orig_byte < rm) // check if block is big enough
+			if (dec->end - *byte < 4) // check if block is big enough
 				fail_out(E_ZBSZ);
-			memcpy(&len, byte[0], 2);
-			memcpy(&nlen, byte[2], 2);
+			len = (*byte)[0] | ((*byte)[1] << 8);
+			nlen = (*byte)[2] | ((*byte)[3] << 8);
 			*byte += 4;
-			if (len != ~nlen) // check ones' complement
+			if (len != (unsigned short)~nlen) // check ones' complement
 				fail_out(E_ZNLEN);
-			decompr_write_str(dec, *byte, len)
+			if (dec->end - *byte < len)
+				fail_out(E_ZBSZ);
+			decompr_write_str(dec, *byte, len);
 			*byte += len;
 			break;
 		case 2: // dynamic Huffman codes
-			i = read_bits32(byte, bit, 14);
-			hlit = MASK(i, 0, 5) + 257;
-			hdist = MASK(i, 5, 10) + 1;
-			hclen = MASK(i, 10, 14) + 4;
-			if (hlit > 286)
-				fail_out(E_ZINV); // others fine due to capping at #bit max
-			form_d1(&h1, byte, bit, hclen);
-			form_d2(&h1, &h2, &h3, byte, bit, hlit, hdist);
-			goto decomp;
+			read_dynamic_trees(dec, byte, bit);
+			do_decompress(dec, &dec->h2, &dec->h3, byte, bit);
+			h_tree_deinit(&dec->h1);
+			h_tree_deinit(&dec->h2);
+			h_tree_deinit(&dec->h3);
+			break;
 		case 1: // fixed Huffman codes
-			h1.tree = NULL;
-			h2.tree = NULL;
-			h2.sz = H_TREE_SZ_FL;
-			h3.tree = NULL;
-			h3.sz = H_TREE_SZ_FD;
-decomp:
-			if ((ret = do_decompress(dec, &h2, &h3, byte, bit)) < 0)
-				goto fail;
+			fl.tree = NULL;
+			fl.sz = H_TREE_SZ_FL;
+			fd.tree = NULL;
+			fd.sz = H_TREE_SZ_FD;
+			do_decompress(dec, &fl, &fd, byte, bit);
 			break;
 		default:
 			fail_out(E_ZBTYPE); // 3 is reserved
 	}
 	if (bfinal)
 		ret = bfinal; // bfinal means ret must be 1 to terminate the deflate_block loop in the caller
-fail:
-	h_tree_deinit(&h1);
-	h_tree_deinit(&h2);
-	h_tree_deinit(&h3);
 	return ret;
 }
 
-void deflate_decompress_header(struct deflate_decompr* dec, unsigned char** _byte, unsigned char* cap){
+// Read the zlib header (rfc1950 2.2), checking that the preset dictionary 'dict' is the one it asks for, if any
+void deflate_decompress_header(struct deflate_decompr* dec, unsigned char** _byte, unsigned char* cap, const struct string_len* dict){
 	unsigned char cinfo;
 	unsigned char* byte = *_byte;
 	if (cap - byte < 2) // need room for at least CMF byte and FLG byte
 		fail_out(E_ZHEAD);
 	if ((((unsigned short)byte[0] << 8) | (unsigned short)byte[1]) % 31) // need CMF*256 + FLG to be a multiple of 31
 		fail_out(E_ZFCHCK);
-	if (byte[0] & 0xf != 8) // need compression method (cm) of 8 (deflate)
+	if ((byte[0] & 0xf) != 8) // need compression method (cm) of 8 (deflate)
 		fail_out(E_ZCMPMT);
 	cinfo = (byte[0] >> 4) & 0x0f;
 	// cinfo is log2(sliding window) - 8
 	if (cinfo > 7) // need sliding window <= 32768
 		fail_out(E_ZSLWIN);
 	dec->sliding_window = 1ULL << (cinfo + 8);
-	if (byte[1] & 0x20){ // preset dictionary
-		// FUTURE: I don't have any knowledge of existing dictionaries, and I REALLY shouldn't need to for png files...
-		fail_out(E_ZPDICT);
-		// otherwise, *_byte += 6 + extra bytes;
+	if (byte[1] & 0x20){ // preset dictionary, identified by its adler32 checksum (DICTID)
+		if (cap - byte < 6)
+			fail_out(E_ZHEAD);
+		if (!dict || adler32_update(1, dict->str, dict->len)
+			!= (((unsigned int)byte[2] << 24) | ((unsigned int)byte[3] << 16) | ((unsigned int)byte[4] << 8) | byte[5]))
+			fail_out(E_ZPDICT);
+		*_byte += 4;
+	}
+	else{
+		dict = NULL; // the data does not refer back into any dictionary
 	}
 	// FLEVEL not needed
 	*_byte += 2;
+
+	// the dictionary comes before the output, as if it had just been decompressed
+	if (dict && dict->len){
+		decompr_write_str(dec, dict->str, dict->len);
+		dec->start = dec->sz;
+	}
+}
+
+// Check the adler32 checksum 'a32' of the output against the zlib trailer (rfc1950 2.2) after the final block, which ends at '*byte' and 'bit'
+static void deflate_decompress_trailer(const struct deflate_decompr* dec, unsigned char* byte, int bit, unsigned int a32){
+	byte_roundup(byte, bit);
+	if (byte > dec->end) // the blocks ran into the checksum
+		fail_out(E_ZBSZ);
+	if (a32 != (((unsigned int)byte[0] << 24) | ((unsigned int)byte[1] << 16) | ((unsigned int)byte[2] << 8) | byte[3]))
+		fail_out(E_ZADL32);
 }
 
 // Decompresses the data from 'compr_dat' into 'decompr_dat' with options 'ops'
 int deflate_decompress(struct string_len* decompr_dat, struct string_len* compr_dat, int ops){
+	return deflate_decompress_dict(decompr_dat, compr_dat, NULL, ops);
+}
+
+/* Decompresses the data from 'compr_dat' into 'decompr_dat' with options 'ops'
+	If the data was compressed with a preset dictionary (FDICT), 'dict' must be that same dictionary; else it is ignored
+*/
+int deflate_decompress_dict(struct string_len* decompr_dat, struct string_len* compr_dat, const struct string_len* dict, int ops){
 	int ret = 0;
 	struct deflate_decompr dec;
-	unsigned char* byte, * cap;
-	unsigned int a32;
+	unsigned char* byte;
 	int bit = 0;
 	decompr_dat->str = NULL; // poison values if error
 	decompr_dat->len = 0;
-	
+
 	if (compr_dat->len == 0) // no data, skip
-		goto fail;
-	if ((dec.d = malloc(DEFLATE_DECOMP_INIT_SZ)) == NULL)
+		return 0;
+	decompr_init(&dec);
+	if (!(ret = fail_checkpoint())){
+		if (compr_dat->len < 2 + sizeof(unsigned int))
+			fail_out(E_ZHEAD);
+		byte = compr_dat->str;
+		dec.end = byte + compr_dat->len - sizeof(unsigned int); // take off adler32
+		// header
+		deflate_decompress_header(&dec, &byte, dec.end, dict);
+		// blocks
+		// 3.2.3 procedure
+		while (!deflate_block(&dec, &byte, &bit));
+		// footer
+		deflate_decompress_trailer(&dec, byte, bit, adler32_update(1, dec.d + dec.start, dec.sz - dec.start));
+		if (dec.start){ // drop the dictionary
+			memmove(dec.d, dec.d + dec.start, dec.sz - dec.start);
+			dec.sz -= dec.start;
+		}
+		if ((ops & DEFLATE_NULLTERM) && (!dec.sz || dec.d[dec.sz - 1] != 0)) // write \0 if options say so
+			decompr_write_char(&dec, 0);
+		decompr_dat->str = realloc(dec.d, max(dec.sz, 1)); // shouldn't fail because reducing size
+		decompr_dat->len = dec.sz;
+		dec.d = NULL;
+	}
+	fail_uncheckpoint();
+	decompr_deinit(&dec);
+	return ret;
+}
+
+/* Random access into compressed data (after zran.c in zlib)
+	deflate_index_build decompresses the data once, and at the first block to start at least 'span' bytes of output after
+		the last seek point, records a new one: where the block starts in the compressed data (byte and bit), how much output
+		comes before it, and the last sliding window of that output. Only that much of the output is kept as it goes.
+	deflate_index_extract then starts decompressing at the last seek point at or before the range it is asked for, with its
+		window as history, just like a preset dictionary. It decompresses whole blocks, so at most 'span' bytes and a block
+		of output are decompressed before the range.
+*/
+
+// Builds the index 'idx' of the zlib data 'compr_dat' with a seek point every 'span' bytes of output; returns 0 or the error
+//	'idx' must be freed with deflate_index_free, even on error
+int deflate_index_build(struct deflate_index* idx, const struct string_len* compr_dat, size_t span){
+	int ret, bit = 0, final = 0;
+	struct deflate_decompr dec;
+	struct deflate_point* pt;
+	unsigned char* byte;
+	unsigned int a32 = 1;
+	size_t base = 0; // output dropped from the front of dec.d
+	size_t summed = 0; // bytes of dec.d already added to 'a32'
+	idx->points = NULL;
+	idx->n = 0;
+	idx->len = 0;
+	decompr_init(&dec);
+	if (!(ret = fail_checkpoint())){
+		if (!span)
+			fail_out(E_RANGE);
+		if (compr_dat->len < 2 + sizeof(unsigned int))
+			fail_out(E_ZHEAD);
+		byte = compr_dat->str;
+		dec.end = byte + compr_dat->len - sizeof(unsigned int);
+		deflate_decompress_header(&dec, &byte, dec.end, NULL);
+		idx->sliding_window = dec.sliding_window;
+		while (!final){
+			if (!idx->n || base + dec.sz >= idx->points[idx->n - 1].out + span){ // new seek point
+				if (a_list_add((void**)&idx->points, &idx->n, sizeof(struct deflate_point)))
+					fail_out(E_MALLOC);
+				pt = idx->points + idx->n - 1;
+				pt->in = byte - compr_dat->str;
+				pt->bit = bit;
+				pt->out = base + dec.sz;
+				pt->window_len = min(dec.sz, dec.sliding_window);
+				if (pt->window_len){ // none at the start of the output, where dec.d may still be NULL
+					if (!(pt->window = malloc(pt->window_len)))
+						fail_out(E_MALLOC);
+					memcpy(pt->window, dec.d + dec.sz - pt->window_len, pt->window_len);
+				}
+			}
+			final = deflate_block(&dec, &byte, &bit);
+			a32 = adler32_update(a32, dec.d + summed, dec.sz - summed);
+			summed = dec.sz;
+			if (dec.sz >= 2 * dec.sliding_window){ // drop all but the sliding window
+				memmove(dec.d, dec.d + dec.sz - dec.sliding_window, dec.sliding_window);
+				base += dec.sz - dec.sliding_window;
+				dec.sz = summed = dec.sliding_window;
+			}
+		}
+		deflate_decompress_trailer(&dec, byte, bit, a32);
+		idx->len = base + dec.sz;
+	}
+	fail_uncheckpoint();
+	decompr_deinit(&dec);
+	return ret;
+}
+
+// Frees the seek points of the index 'idx'
+void deflate_index_free(struct deflate_index* idx){
+	unsigned int i;
+	for (i = 0; i < idx->n; i++)
+		free(idx->points[i].window);
+	freec(idx->points);
+	idx->n = 0;
+}
+
+/* Decompresses the 'len' bytes of output at 'off' of the zlib data 'compr_dat' into 'decompr_dat', using the index 'idx' of it
+	The data isn't checked against its adler32 checksum, which covers all of it. Returns 0 or the error
+*/
+int deflate_index_extract(struct string_len* decompr_dat, const struct deflate_index* idx, const struct string_len* compr_dat, size_t off, size_t len){
+	int ret, bit, lo, hi, mid;
+	struct deflate_decompr dec;
+	const struct deflate_point* pt;
+	unsigned char* byte;
+	size_t skip;
+	decompr_dat->str = NULL;
+	decompr_dat->len = 0;
+	decompr_init(&dec);
+	if (!(ret = fail_checkpoint())){
+		if (!idx->n || off > idx->len || len > idx->len - off)
+			fail_out(E_RANGE);
+		for (lo = 0, hi = idx->n - 1; lo < hi;){ // the last seek point at or before 'off'
+			mid = (lo + hi + 1) / 2;
+			if (idx->points[mid].out <= off)
+				lo = mid;
+			else
+				hi = mid - 1;
+		}
+		pt = idx->points + lo;
+		if (pt->in >= compr_dat->len)
+			fail_out(E_RANGE);
+		dec.sliding_window = idx->sliding_window;
+		dec.end = compr_dat->str + compr_dat->len - sizeof(unsigned int);
+		if (pt->window_len)
+			decompr_write_str(&dec, pt->window, pt->window_len);
+		dec.start = dec.sz;
+		byte = compr_dat->str + pt->in;
+		bit = pt->bit;
+		skip = off - pt->out;
+		while (dec.sz - dec.start < skip + len){
+			if (deflate_block(&dec, &byte, &bit) && dec.sz - dec.start < skip + len) // ended short of the range
+				fail_out(E_ZBSZ);
+		}
+		if (len) // dec.d may be NULL with no output at all
+			memmove(dec.d, dec.d + dec.start + skip, len);
+		decompr_dat->str = realloc(dec.d, max(len, 1)); // shouldn't fail because reducing size
+		decompr_dat->len = len;
+		dec.d = NULL;
+	}
+	fail_uncheckpoint();
+	decompr_deinit(&dec);
+	return ret;
+}
+
+// Read 'n' big endian bytes at 'p'
+static unsigned long long get_be(const unsigned char* p, int n){
+	unsigned long long x = 0;
+	for (; n > 0; n--)
+		x = x << 8 | *p++;
+	return x;
+}
+
+/* Reads the seek table at the end of the output of deflate_compress_seekable 'compr_dat' into the index 'idx', for
+	deflate_index_extract; the seek points need no window, since the sliding window starts over at each of them.
+	Returns 0 or the error; 'idx' must be freed with deflate_index_free, even on error
+*/
+int deflate_seekable_index(struct deflate_index* idx, const struct string_len* compr_dat){
+	int ret;
+	unsigned int i;
+	size_t n;
+	struct deflate_decompr dec;
+	struct deflate_point* pt;
+	const unsigned char* tail;
+	unsigned char* byte;
+	idx->points = NULL;
+	idx->n = 0;
+	idx->len = 0;
+	decompr_init(&dec);
+	if (!(ret = fail_checkpoint())){
+		if (compr_dat->len < 2 + sizeof(unsigned int) + 16)
+			fail_out(E_ZHEAD);
+		tail = compr_dat->str + compr_dat->len - 16;
+		n = get_be(tail + 8, 4);
+		if (get_be(tail + 12, 4) != DEFLATE_SEEK_MAGIC || n > (compr_dat->len - 2 - sizeof(unsigned int) - 16) / 16)
+			fail_out(E_ZHEAD);
+		byte = compr_dat->str;
+		dec.end = byte + compr_dat->len - sizeof(unsigned int);
+		deflate_decompress_header(&dec, &byte, dec.end, NULL);
+		idx->sliding_window = dec.sliding_window;
+		idx->len = get_be(tail, 8);
+		for (i = 0, tail -= 16 * n; i < n; i++, tail += 16){
+			if (a_list_add((void**)&idx->points, &idx->n, sizeof(struct deflate_point)))
+				fail_out(E_MALLOC);
+			pt = idx->points + i;
+			pt->in = get_be(tail, 8);
+			pt->out = get_be(tail + 8, 8);
+			if (pt->in < 2 || pt->out > idx->len || (i && (pt->in <= pt[-1].in || pt->out <= pt[-1].out)))
+				fail_out(E_ZHEAD);
+		}
+	}
+	fail_uncheckpoint();
+	decompr_deinit(&dec);
+	return ret;
+}
+
+/* Speculative parallel decompression (after pugz)
+	The compressed blocks are split into parts of equal size. The first part is decompressed as usual, and each other one
+		first looks for where a block starts in it, trying one bit after the other: there has to be the header of a
+		dynamic Huffman block there, whose code lengths make complete Huffman codes (see check_code_lens), and the whole
+		block has to decompress.
+	The parts are then decompressed at once, each one up to the first block to start at or after the next part. The chars a
+		part copies from before it aren't known yet, so its output is kept as symbols: a char, or 256 plus the index of a
+		char in the sliding window right before the part. Once all parts are done, their sliding windows are worked out one
+		after the other, from the end of each part, and then the symbols of all parts are replaced by chars at once.
+	A part is only used if the one before it ended right where it starts, so a wrong guess only costs time: what comes after
+		the last part that does fit is decompressed as usual.
+*/
+
+struct deflate_spec{ // part of the compressed data decompressed on a thread of its own (see deflate_decompress_parallel)
+	struct deflate_decompr dec; // Huffman trees and bounds; the output only goes into dec.d for the first part
+	unsigned short* s; // output of the other parts, as symbols: a char, or 256 + the index of a char in 'window'
+	size_t sz; // number of symbols in 's'
+	size_t cap; // capacity of 's'
+	unsigned char* base; // start of the compressed data, which bit offsets count from
+	unsigned char* lo, * hi; // the part: where to look for a block to start
+	size_t from; // bit offset where the first block of the part starts
+	size_t next; // bit offset where the next part starts, or (size_t)-1
+	unsigned char* byte; // where the part has been decompressed up to
+	int bit;
+	int final; // bool, the final block has been decompressed
+	unsigned char first; // bool, the first part, which is decompressed into dec.d as usual
+	unsigned char found; // bool, a block start was found in the part
+	unsigned char* window; // the sliding window before the part; its first dec.sliding_window - 'window_len' chars are unknown
+	size_t window_len;
+	unsigned char* out; // where the chars of the part go
+	unsigned int adler; // adler32 checksum of them
+	int ret; // 0 or the error
+	unsigned char threaded; // bool, the part has a thread of its own ('thread')
+	pthread_t thread;
+};
+
+// Bit offset of 'byte' and 'bit' from 'base'
+static inline size_t spec_pos(const unsigned char* base, const unsigned char* byte, int bit){
+	return (size_t)(byte - base) * 8 + bit;
+}
+
+// Make room for 'len' more symbols in the output of 'sp'
+static void spec_reserve(struct deflate_spec* sp, size_t len){
+	size_t cap = max(sp->cap, DEFLATE_DECOMP_INIT_SZ);
+	if (sp->sz + len <= sp->cap)
+		return;
+	while (cap < sp->sz + len)
+		cap <<= 1;
+	if ((sp->s = realloc(sp->s, cap * sizeof(unsigned short))) == NULL)
 		fail_out(E_MALLOC);
-	dec.sz = DEFLATE_DECOMP_INIT_SZ;
-	byte = compr_dat->str;
-	cap = byte + compr_dat->len - sizeof(unsigned int); // take off adler32
-	// header
-	deflate_decompress_header(&dec, &byte, cap);
-	// blocks
-	// 3.2.3 procedure
-	while (byte < cap){
-		ret = deflate_block(&dec, &byte, &bit, cap - byte)
-		if (ret < 0)
-			goto fail;
-		else if (ret == 1)
+	sp->cap = cap;
+}
+
+// Write the 'len' symbols starting 'dist' back to the output of 'sp'; the ones before the part are its window's
+static void spec_write_dup(struct deflate_spec* sp, unsigned int dist, unsigned int len){
+	unsigned short* p;
+	size_t sw = sp->dec.sliding_window;
+	spec_reserve(sp, len);
+	for (p = sp->s + sp->sz, sp->sz += len; len > 0; len--, p++){
+		*p = (p - sp->s >= dist)? p[-(long)dist] : 256 + sw - (dist - (p - sp->s));
+	}
+}
+
+// Decompress a deflate block into the symbols of 'sp' starting at bit *bit of *byte, as deflate_block does
+static int spec_block(struct deflate_spec* sp, unsigned char** byte, int* bit){
+	struct deflate_decompr* dec = &sp->dec;
+	struct h_tree_head fl, fd, * h2 = &dec->h2, * h3 = &dec->h3;
+	unsigned short len, nlen;
+	int bfinal, btype, ret;
+	decompr_check_bounds(dec, byte);
+	bfinal = read_bits32(byte, bit, 1);
+	btype = read_bits32(byte, bit, 2);
+	switch (btype){
+		case 0: // uncompressed
+			byte_roundup(*byte, *bit);
+			if (dec->end - *byte < 4)
+				fail_out(E_ZBSZ);
+			len = (*byte)[0] | ((*byte)[1] << 8);
+			nlen = (*byte)[2] | ((*byte)[3] << 8);
+			*byte += 4;
+			if (len != (unsigned short)~nlen)
+				fail_out(E_ZNLEN);
+			if (dec->end - *byte < len)
+				fail_out(E_ZBSZ);
+			spec_reserve(sp, len);
+			for (; len > 0; len--)
+				sp->s[sp->sz++] = *(*byte)++;
+			return bfinal;
+		case 1: // fixed Huffman codes
+			fl.tree = fd.tree = NULL;
+			fl.sz = H_TREE_SZ_FL;
+			fd.sz = H_TREE_SZ_FD;
+			h2 = &fl;
+			h3 = &fd;
 			break;
+		case 2: // dynamic Huffman codes
+			read_dynamic_trees(dec, byte, bit);
+			break;
+		default:
+			fail_out(E_ZBTYPE);
 	}
-	// footer
-	if (ops | DEFLATE_NULLTERM && dec.d[dec.sz - 1] != 0) // write \0 if options say so
-		decompr_write_char(&dec, 0);
-	realloc(dec.d, dec.sz); // shouldn't fail because reducing size
-	memcpy(&a32, cap, sizeof(unsigned int));
-	if (adler32(dec.d, dec.sz) != a32)
-		fail_out(E_ZADL32);
-	decompr_dat->str = dec.d;
-	decompr_dat->len = dec.sz;
-fail:
+	for (;;){ // as do_decompress does
+		decompr_check_bounds(dec, byte);
+		ret = _h_tree_lookup(h2, byte, bit);
+		if (ret == 256)
+			break;
+		if (ret < 256){
+			spec_reserve(sp, 1);
+			sp->s[sp->sz++] = ret;
+		}
+		else if (ret < 286){
+			ret = read_len(ret, byte, bit);
+			spec_write_dup(sp, read_dist(dec, h3, byte, bit), ret);
+		}
+		else
+			fail_out(E_HUFVAL);
+	}
+	h_tree_deinit(&dec->h1);
+	h_tree_deinit(&dec->h2);
+	h_tree_deinit(&dec->h3);
+	return bfinal;
+}
+
+// Whether a dynamic Huffman block that isn't the final one may start at 'byte' and 'bit': a quick look at its header
+//	that fails most of the bits it is tried at, before spec_block decompresses the block to be sure
+static int spec_guess(unsigned char* byte, int bit){
+	struct code_len cls[19];
+	unsigned int i, hclen;
+	if (read_bits32(&byte, &bit, 3) != 4) // BFINAL = 0, BTYPE = 10
+		return 0;
+	i = read_bits32(&byte, &bit, 14);
+	if (MASK(i, 0, 5) > 29 || MASK(i, 5, 10) > 29)
+		return 0;
+	hclen = MASK(i, 10, 14) + 4;
+	for (i = 0; i < 19; i++)
+		cls[i].len = (i < hclen)? read_bits32(&byte, &bit, 3) : 0;
+	if (fail_checkpoint()){ // not a complete code
+		fail_uncheckpoint();
+		return 0;
+	}
+	check_code_lens(cls, 19, 0);
+	fail_uncheckpoint();
+	return 1;
+}
+
+// Find where the first block of the struct deflate_spec 'arg' starts in it, and decompress that block
+static void* deflate_spec_find(void* arg){
+	struct deflate_spec* sp = arg;
+	unsigned char* byte, * b;
+	int bit, t;
+	size_t at; // bit offset being tried
+	for (at = (sp->lo - sp->base) * 8; !sp->found && at < (size_t)(sp->hi - sp->base) * 8; at++){
+		byte = sp->base + at / 8;
+		bit = at % 8;
+		if (sp->dec.end - byte < 16 || !spec_guess(byte, bit)) // 16 bytes for the header before the bounds are checked
+			continue;
+		if (!fail_checkpoint()){
+			b = byte;
+			t = bit;
+			spec_block(sp, &b, &t);
+			sp->from = at;
+			sp->byte = b;
+			sp->bit = t;
+			sp->found = 1;
+		}
+		else{ // not a block after all
+			h_tree_deinit(&sp->dec.h1);
+			h_tree_deinit(&sp->dec.h2);
+			h_tree_deinit(&sp->dec.h3);
+			sp->sz = 0;
+		}
+		fail_uncheckpoint();
+	}
+	return NULL;
+}
+
+// Decompress the struct deflate_spec 'arg' up to the first block to start at or after the next part
+static void* deflate_spec_run(void* arg){
+	struct deflate_spec* sp = arg;
+	if (!(sp->ret = fail_checkpoint())){
+		while (!sp->final && spec_pos(sp->base, sp->byte, sp->bit) < sp->next){
+			sp->final = (sp->first)? deflate_block(&sp->dec, &sp->byte, &sp->bit) : spec_block(sp, &sp->byte, &sp->bit);
+		}
+	}
+	fail_uncheckpoint();
+	return NULL;
+}
+
+// Write the chars of 'n' symbols 's' to 'out', from the sliding window 'window' of 'sw' chars, the last 'len' of them known
+static void spec_resolve(unsigned char* out, const unsigned short* s, size_t n, const unsigned char* window, size_t sw, size_t len){
+	for (; n > 0; n--, s++){
+		if (*s < 256)
+			*out++ = *s;
+		else if (*s - 256 >= sw - len)
+			*out++ = window[*s - 256];
+		else // before the start of the output
+			fail_out(E_HUFDIS);
+	}
+}
+
+// Replace the symbols of the struct deflate_spec 'arg' by chars, and sum them up
+static void* deflate_spec_resolve(void* arg){
+	struct deflate_spec* sp = arg;
+	if (!(sp->ret = fail_checkpoint())){
+		spec_resolve(sp->out, sp->s, sp->sz, sp->window, sp->dec.sliding_window, sp->window_len);
+		sp->adler = adler32_update(1, sp->out, sp->sz);
+	}
+	fail_uncheckpoint();
+	return NULL;
+}
+
+// Run 'f' on the 'n' parts 'sps' at once, each on a thread of its own where one can be had
+static void spec_run_all(struct deflate_spec* sps, int n, void* (*f)(void*)){
+	int i;
+	for (i = 0; i < n; i++){
+		sps[i].threaded = !pthread_create(&sps[i].thread, NULL, f, sps + i);
+		if (!sps[i].threaded) // make do without
+			f(sps + i);
+	}
+	for (i = 0; i < n; i++)
+		if (sps[i].threaded)
+			pthread_join(sps[i].thread, NULL);
+}
+
+/* Decompresses the data from 'compr_dat' into 'decompr_dat' with options 'ops' as deflate_decompress does, on up to 'threads'
+	threads at once (see above); the data is split into one part per thread, but no part is smaller than DEFLATE_SPEC_PART_MIN
+*/
+int deflate_decompress_parallel(struct string_len* decompr_dat, struct string_len* compr_dat, int ops, int threads){
+	int ret, i, j, n, bit, final;
+	volatile int parts = 0; // number of parts allocated; volatile, as it and 'sps' are set after the checkpoint and used after a failure
+	unsigned int a32;
+	size_t len, sw, total;
+	unsigned char* byte, * body, * prev;
+	struct deflate_spec* volatile sps = NULL;
+	struct deflate_spec* sp;
+	struct deflate_decompr* dec; // the first part's, which ends up with all of the output
+	decompr_dat->str = NULL;
+	decompr_dat->len = 0;
+	if (!(ret = fail_checkpoint())){
+		if (threads < 1)
+			fail_out(E_RANGE);
+		if (compr_dat->len < 2 + sizeof(unsigned int))
+			fail_out(E_ZHEAD);
+		len = compr_dat->len - 2 - sizeof(unsigned int);
+		n = max(1, min((size_t)threads, len / DEFLATE_SPEC_PART_MIN));
+		if (!(sps = calloc(n, sizeof(struct deflate_spec))))
+			fail_out(E_MALLOC);
+		for (parts = n, i = 0; i < n; i++)
+			decompr_init(&sps[i].dec);
+		dec = &sps[0].dec;
+		byte = compr_dat->str;
+		dec->end = byte + compr_dat->len - sizeof(unsigned int);
+		deflate_decompress_header(dec, &byte, dec->end, NULL);
+		body = byte;
+		sw = dec->sliding_window;
+		for (i = 0; i < n; i++){
+			sp = sps + i;
+			sp->dec.end = dec->end;
+			sp->dec.sliding_window = sw;
+			sp->base = compr_dat->str;
+			sp->lo = body + len * i / n;
+			sp->hi = body + len * (i + 1) / n;
+		}
+		sps[0].byte = body;
+		sps[0].bit = 0;
+		sps[0].from = spec_pos(sps[0].base, body, 0);
+		sps[0].first = sps[0].found = 1;
+
+		// find where the parts start, keeping only the ones that do
+		spec_run_all(sps + 1, n - 1, deflate_spec_find);
+		for (i = j = 1; i < n; i++){
+			if (!sps[i].found){
+				freec(sps[i].s);
+			}
+			else if (i != j++){
+				sps[j - 1] = sps[i];
+				sps[i].s = NULL;
+				decompr_init(&sps[i].dec);
+			}
+		}
+		n = j;
+		for (i = 0; i < n; i++)
+			sps[i].next = (i + 1 < n)? sps[i + 1].from : (size_t)-1;
+
+		// decompress them, and keep the ones that fit
+		spec_run_all(sps, n, deflate_spec_run);
+		for (i = 0; i < n; i++){
+			if (sps[i].ret)
+				fail_out(sps[i].ret);
+			if (sps[i].final || i + 1 == n || spec_pos(sps[i].base, sps[i].byte, sps[i].bit) != sps[i + 1].from)
+				break;
+		}
+		n = i + 1;
+
+		// work out their sliding windows one after the other, then their chars at once
+		for (i = 1, total = dec->sz; i < n; total += sps[i++].sz){
+			sp = sps + i;
+			if (!(sp->window = malloc(sw)))
+				fail_out(E_MALLOC);
+			if (i == 1){ // the end of the first part's output
+				sp->window_len = min(sw, dec->sz);
+				memcpy(sp->window + sw - sp->window_len, dec->d + dec->sz - sp->window_len, sp->window_len);
+			}
+			else if (sps[i - 1].sz >= sw){ // the end of the part before it
+				sp->window_len = sw;
+				spec_resolve(sp->window, sps[i - 1].s + sps[i - 1].sz - sw, sw, sps[i - 1].window, sw, sps[i - 1].window_len);
+			}
+			else{ // the end of the part before it, after the end of the window before that
+				prev = sps[i - 1].window;
+				sp->window_len = min(sw, sps[i - 1].window_len + sps[i - 1].sz);
+				memcpy(sp->window, prev + sps[i - 1].sz, sw - sps[i - 1].sz);
+				spec_resolve(sp->window + sw - sps[i - 1].sz, sps[i - 1].s, sps[i - 1].sz, prev, sw, sps[i - 1].window_len);
+			}
+		}
+		decompr_reserve(dec, total - dec->sz);
+		for (i = 1, len = dec->sz; i < n; len += sps[i++].sz)
+			sps[i].out = dec->d + len;
+		spec_run_all(sps + 1, n - 1, deflate_spec_resolve);
+		a32 = adler32_update(1, dec->d, dec->sz);
+		for (i = 1; i < n; i++){
+			if (sps[i].ret)
+				fail_out(sps[i].ret);
+			a32 = adler32_combine(a32, sps[i].adler, sps[i].sz);
+		}
+		dec->sz = total;
+
+		// decompress the rest as usual, if the parts stopped short of it
+		byte = sps[n - 1].byte;
+		bit = sps[n - 1].bit;
+		for (final = sps[n - 1].final; !final;){
+			len = dec->sz;
+			final = deflate_block(dec, &byte, &bit);
+			a32 = adler32_update(a32, dec->d + len, dec->sz - len);
+		}
+		deflate_decompress_trailer(dec, byte, bit, a32);
+		if ((ops & DEFLATE_NULLTERM) && (!dec->sz || dec->d[dec->sz - 1] != 0))
+			decompr_write_char(dec, 0);
+		decompr_dat->str = realloc(dec->d, max(dec->sz, 1)); // shouldn't fail because reducing size
+		decompr_dat->len = dec->sz;
+		dec->d = NULL;
+	}
+	fail_uncheckpoint();
+	for (i = 0; i < parts; i++){
+		decompr_deinit(&sps[i].dec);
+		free(sps[i].s);
+		free(sps[i].window);
+	}
+	free(sps);
+	return ret;
+}
+
+/* Streaming decompression (after zlib's inflate)
+	deflate_decompr_stream_push takes the compressed data in pieces of any size, and hands the output back in pieces of any
+		size. It decompresses a step at a time: the zlib header, the header of a block (the trees of a dynamic Huffman block
+		included), part of a stored block, a run of symbols, or the adler32 checksum.
+	A step is taken straight from the input given if there is plenty of it left, and otherwise from 'pend', which keeps the
+		end of the input until there is more. A step that runs out of input in 'pend' is undone, to be taken again with more,
+		so that only 'pend' has to have room for the largest step.
+	The output goes to a sliding window in dec.d, and is copied out from there; once more than a sliding window of it is
+		waiting to be copied out, decompression waits too, so that at most two sliding windows and a dup string are kept.
+*/
+
+#define DSTREAM_STEP_MAX 1024 // most input a step takes: the header of a dynamic Huffman block is up to 563 bytes
+#define DSTREAM_PAD 16 // zeros after the input in 'pend', which a step may read a little into before it checks its bounds
+
+enum dstream_state{ DS_HEADER, DS_BLOCK, DS_STORED, DS_CODES, DS_TRAILER, DS_DONE };
+
+struct deflate_decompr_stream{
+	struct deflate_decompr dec; // the sliding window of output in dec.d, and the Huffman trees of the current block
+	const struct string_len* dict; // preset dictionary, or NULL
+	enum dstream_state state; // what the next step is
+	int bfinal; // bool, the current block is the final one
+	struct h_tree_head* h2, * h3; // literal/length and distance Huffman trees of the current block
+	struct h_tree_head fl, fd; // fixed Huffman trees
+	size_t stored; // chars left in the current stored block
+	size_t out; // chars of dec.d copied out
+	size_t summed; // chars of dec.d added to 'adler'
+	unsigned int adler;
+	unsigned char* at; // where the next step starts in the input
+	int bit; // and at which bit of it
+	unsigned char pend[2 * DSTREAM_STEP_MAX + DSTREAM_PAD]; // input kept for later (see above)
+	size_t pend_len;
+};
+
+SPAWNABLE(deflate_decompr_stream_t);
+
+// Initialize 'ds' to decompress a zlib stream, with the preset dictionary 'dict' (or NULL), which must outlive the zlib header
+void deflate_decompr_stream_init(deflate_decompr_stream_t* ds, const struct string_len* dict){
+	decompr_init(&ds->dec);
+	ds->dict = dict;
+	ds->state = DS_HEADER;
+	ds->fl.tree = ds->fd.tree = NULL;
+	ds->fl.sz = H_TREE_SZ_FL;
+	ds->fd.sz = H_TREE_SZ_FD;
+	ds->out = ds->summed = ds->stored = 0;
+	ds->adler = 1;
+	ds->bit = 0;
+	ds->pend_len = 0;
+}
+
+// Deinitialize 'ds'
+void deflate_decompr_stream_deinit(deflate_decompr_stream_t* ds){
+	decompr_deinit(&ds->dec);
+}
+
+// Make room for a dup string in the sliding window of 'ds' by dropping output that has been copied out and is out of reach
+static void dstream_slide(deflate_decompr_stream_t* ds){
+	struct deflate_decompr* dec = &ds->dec;
+	size_t k;
+	if (dec->cap - dec->sz >= 258 || dec->sz <= dec->sliding_window)
+		return;
+	ds->adler = adler32_update(ds->adler, dec->d + ds->summed, dec->sz - ds->summed);
+	k = min(ds->out, dec->sz - dec->sliding_window);
+	memmove(dec->d, dec->d + k, dec->sz - k);
+	dec->sz -= k;
+	ds->out -= k;
+	ds->summed = dec->sz;
+}
+
+// Decompress a run of symbols of the current block of 'ds', up to the end of the block, near the end of the input, or until the
+//	sliding window is full; a symbol starting more than 12 bytes before the end (48 bits, and reading ahead) ends before it
+static void dstream_codes(deflate_decompr_stream_t* ds){
+	struct deflate_decompr* dec = &ds->dec;
+	int ret, len, dist;
+	do{ // at least one symbol, which may run past the input
+		decompr_check_bounds(dec, &ds->at);
+		ret = _h_tree_lookup(ds->h2, &ds->at, &ds->bit);
+		if (ret == 256){ // end of block symbol; its trees are freed by the next step, as this one may be undone
+			ds->state = (ds->bfinal)? DS_TRAILER : DS_BLOCK;
+			return;
+		}
+		if (ret < 256){
+			decompr_write_char(dec, (unsigned char)ret);
+		}
+		else if (ret < 286){
+			len = read_len(ret, &ds->at, &ds->bit);
+			dist = read_dist(dec, ds->h3, &ds->at, &ds->bit);
+			if (dist > dec->sz)
+				fail_out(E_HUFDIS);
+			decompr_write_dup(dec, dist, len);
+		}
+		else
+			fail_out(E_HUFVAL);
+	} while (dec->end - ds->at > 12 && dec->cap - dec->sz >= 258);
+}
+
+// Take the next step of decompressing with 'ds' (see above); one that runs out of input fails out with E_ZBSZ, if nothing else
+static void dstream_step(deflate_decompr_stream_t* ds){
+	struct deflate_decompr* dec = &ds->dec;
+	unsigned char* end = dec->end;
+	size_t n;
+	switch (ds->state){
+		case DS_HEADER:
+			if (end - ds->at < 2 || (end - ds->at < 6 && (ds->at[1] & 0x20))) // with its DICTID
+				fail_out(E_ZBSZ);
+			deflate_decompress_header(dec, &ds->at, end, ds->dict);
+			if (dec->sz > dec->sliding_window){ // only the end of the dictionary can be reached
+				memmove(dec->d, dec->d + dec->sz - dec->sliding_window, dec->sliding_window);
+				dec->sz = dec->sliding_window;
+			}
+			decompr_reserve(dec, 2 * dec->sliding_window + 258);
+			ds->out = ds->summed = dec->sz;
+			ds->state = DS_BLOCK;
+			break;
+		case DS_BLOCK:
+			h_tree_deinit(&dec->h1);
+			h_tree_deinit(&dec->h2);
+			h_tree_deinit(&dec->h3);
+			decompr_check_bounds(dec, &ds->at);
+			ds->bfinal = read_bits32(&ds->at, &ds->bit, 1);
+			switch (read_bits32(&ds->at, &ds->bit, 2)){
+				case 0: // uncompressed
+					byte_roundup(ds->at, ds->bit);
+					if (end - ds->at < 4)
+						fail_out(E_ZBSZ);
+					ds->stored = ds->at[0] | (ds->at[1] << 8);
+					if (ds->stored != (unsigned short)~(ds->at[2] | (ds->at[3] << 8)))
+						fail_out(E_ZNLEN);
+					ds->at += 4;
+					ds->state = DS_STORED;
+					break;
+				case 1: // fixed Huffman codes
+					ds->h2 = &ds->fl;
+					ds->h3 = &ds->fd;
+					ds->state = DS_CODES;
+					break;
+				case 2: // dynamic Huffman codes
+					read_dynamic_trees(dec, &ds->at, &ds->bit);
+					ds->h2 = &dec->h2;
+					ds->h3 = &dec->h3;
+					ds->state = DS_CODES;
+					break;
+				default:
+					fail_out(E_ZBTYPE);
+			}
+			break;
+		case DS_STORED:
+			n = min(ds->stored, min((size_t)(end - ds->at), dec->cap - dec->sz));
+			if (!n && ds->stored)
+				fail_out(E_ZBSZ);
+			decompr_write_str(dec, ds->at, n);
+			ds->at += n;
+			if (!(ds->stored -= n))
+				ds->state = (ds->bfinal)? DS_TRAILER : DS_BLOCK;
+			break;
+		case DS_CODES:
+			dstream_codes(ds);
+			break;
+		case DS_TRAILER:
+			byte_roundup(ds->at, ds->bit);
+			if (end - ds->at < 4)
+				fail_out(E_ZBSZ);
+			ds->adler = adler32_update(ds->adler, dec->d + ds->summed, dec->sz - ds->summed);
+			ds->summed = dec->sz;
+			if (ds->adler != (((unsigned int)ds->at[0] << 24) | ((unsigned int)ds->at[1] << 16) | ((unsigned int)ds->at[2] << 8) | ds->at[3]))
+				fail_out(E_ZADL32);
+			ds->at += 4;
+			ds->state = DS_DONE;
+			break;
+		case DS_DONE:
+			break;
+	}
+}
+
+// Take steps with 'ds' from its input up to dec.end, leaving 'margin' chars of it; returns whether any were taken
+static int dstream_steps(deflate_decompr_stream_t* ds, size_t margin){
+	struct deflate_decompr* dec = &ds->dec;
+	enum dstream_state state;
+	unsigned char* at;
+	int ret, bit, took = 0;
+	size_t sz;
+	while (ds->state != DS_DONE && (size_t)(dec->end - ds->at) >= margin){
+		if (ds->state != DS_HEADER){
+			dstream_slide(ds);
+			if (dec->cap - dec->sz < 258) // wait for the output to be copied out
+				break;
+		}
+		state = ds->state;
+		sz = dec->sz;
+		at = ds->at;
+		bit = ds->bit;
+		if (!(ret = fail_checkpoint()))
+			dstream_step(ds);
+		fail_uncheckpoint();
+		if (ds->at > dec->end || (ds->at == dec->end && ds->bit) || ret == E_ZBSZ){ // ran out of input: undo the step
+			if (state == DS_BLOCK){
+				h_tree_deinit(&dec->h1);
+				h_tree_deinit(&dec->h2);
+				h_tree_deinit(&dec->h3);
+			}
+			ds->state = state;
+			dec->sz = sz;
+			ds->at = at;
+			ds->bit = bit;
+			break;
+		}
+		if (ret)
+			fail_out(ret);
+		took = 1;
+	}
+	return took;
+}
+
+/* Decompresses the 'in_len' bytes at 'in', the next piece of the zlib stream of 'ds', into the 'out_cap' bytes at 'out'
+	'*in_used' is set to how much of the input was taken, and '*out_len' to how much output was written. All of the input is
+		taken unless the output is full, or the stream ends before it. Returns 0 if there may be more to come,
+		DEFLATE_STREAM_END once the whole stream has been decompressed and its adler32 checksum checked, or the error
+*/
+int deflate_decompr_stream_push(deflate_decompr_stream_t* ds, const unsigned char* in, size_t in_len, size_t* in_used, unsigned char* out, size_t out_cap, size_t* out_len){
+	int ret, took;
+	size_t n, kept, used;
+	struct deflate_decompr* dec = &ds->dec;
+	*in_used = *out_len = 0;
+	if (!(ret = fail_checkpoint())){
+		do{
+			if ((n = min(out_cap - *out_len, dec->sz - ds->out))){ // copy out what is waiting
+				memcpy(out + *out_len, dec->d + ds->out, n);
+				*out_len += n;
+				ds->out += n;
+			}
+			if (ds->state == DS_DONE){
+				if (ds->out == dec->sz) // all of it
+					ret = DEFLATE_STREAM_END;
+				break;
+			}
+			if (!ds->pend_len && in_len - *in_used >= DSTREAM_STEP_MAX + DSTREAM_PAD){ // straight from the input
+				ds->at = (unsigned char*)in + *in_used;
+				dec->end = (unsigned char*)in + in_len;
+				took = dstream_steps(ds, DSTREAM_STEP_MAX + DSTREAM_PAD);
+				*in_used = ds->at - in;
+			}
+			else{ // from 'pend', with as much of the input as fits after what it kept before
+				kept = ds->pend_len;
+				n = min(in_len - *in_used, sizeof(ds->pend) - DSTREAM_PAD - kept);
+				memcpy(ds->pend + kept, in + *in_used, n);
+				memset(ds->pend + kept + n, 0, DSTREAM_PAD);
+				ds->pend_len += n;
+				*in_used += n;
+				ds->at = ds->pend;
+				dec->end = ds->pend + ds->pend_len;
+				took = dstream_steps(ds, 0);
+				used = ds->at - ds->pend;
+				if (used >= kept && (ds->state == DS_DONE || in_len - *in_used + ds->pend_len - used >= DSTREAM_STEP_MAX + DSTREAM_PAD)){
+					// past what was kept before, and the rest of the input can be taken straight: give it back
+					*in_used -= ds->pend_len - used;
+					ds->pend_len = 0;
+				}
+				else{
+					memmove(ds->pend, ds->at, ds->pend_len - used);
+					ds->pend_len -= used;
+				}
+			}
+		} while (took);
+		if (ret != DEFLATE_STREAM_END && !ds->pend_len && ds->bit){ // keep the byte the next step starts in
+			ds->pend[0] = in[(*in_used)++];
+			ds->pend_len = 1;
+		}
+	}
+	fail_uncheckpoint();
 	return ret;
 }
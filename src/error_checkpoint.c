@@ -1,4 +1,4 @@
-#include <setjmp.h>
-#include "include/global_errors.h"
-int checkpoint_stack = 0;
-jmp_buf checkpoints[MAX_CHECKPOINTS];
+#include <setjmp.h>
+#include "include/global_errors.h"
+_Thread_local int checkpoint_stack = 0;
+_Thread_local jmp_buf checkpoints[MAX_CHECKPOINTS];
@@ -13,6 +13,7 @@ void h_tree_init(struct h_tree_head* h, int sz){
 	if ((h->tree = calloc(sz, sizeof(struct h_tree_node))) == NULL)
 		fail_out(E_MALLOC);
 	h->sz = 0;
+	h->cap = sz;
 }
 
 // Deinitialize the Huffman tree 'h'
@@ -40,25 +41,31 @@ int h_tree_lookup(const struct h_tree_head* h, unsigned char** byte, int* bit){
 }
 
 // Adds the Huffman code 'c' of code length 'codelen' that encodes non-negative value 'val' to the Huffman tree 'h'
+//	'c' is read starting with its most significant bit, as h_tree_lookup reads it from the input
 void h_tree_add(struct h_tree_head* h, h_code c, int codelen, int val){
-	short i = 0;
-	struct h_tree_node* t;
-	short* v = &i; // point to zero to start
+	struct h_tree_node* t = h->tree; // root
+	short* v;
 	if (c >= H_CODE_1 << codelen) // Huffman code is bigger than its codelen
 		fail_out(E_HUFINV);
-	for (; i < codelen; i++, c >>= 1){
+	if (!h->sz) // room for the root
+		h->sz = 1;
+	for (codelen--;; codelen--){
+		if ((c >> codelen) & H_CODE_1)
+			v = &t->left;
+		else
+			v = &t->right;
+		if (!codelen)
+			break;
 		if (*v < 0){
 			fail_out(E_HUFAMB);
 		}
 		else if (*v == 0){ // new node; point the branch to the next spot at the end of the array
+			if (h->sz == h->cap) // more nodes than a complete code of 'cap' values has
+				fail_out(E_HUFINV);
 			*v = h->sz++;
 		}
 		// follow node
 		t = h->tree + *v;
-		if (c & H_CODE_1)
-			v = &t->right;
-		else
-			v = &t->left;
 	}
 	// check that leaf is empty or that the correct val is already there
 	if (*v != 0 && *v != H_TREE_REP(val)){
@@ -174,6 +181,7 @@ void h_tree_builder_deinit(struct h_tree_builder* htb){
 void h_tree_builder_reset(struct h_tree_builder* htb){
 	memset(htb->weights, 0, (htb->cap + 1) * sizeof(unsigned int));
 	memset(htb->q, 0, htb->cap * sizeof(struct htbq));
+	htb->head.sz = 0;
 	htb->h0 = -1;
 	htb->h1 = htb->t1 = 0;
 }
@@ -243,7 +251,7 @@ void h_tree_builder_build(struct h_tree_builder* htb){
 	unsigned int p0, p1;
 	int i0, i1;
 	qsort(htb->q, htb->cap, sizeof(struct htbq), htbq_comp);
-	for (htb->h0 = 0; htb->q[htb->h0].weight == 0; htb->h0++); // move h0 to the first nonzero-weight leaf
+	for (htb->h0 = 0; htb->h0 < htb->cap && htb->q[htb->h0].weight == 0; htb->h0++); // move h0 to the first nonzero-weight leaf
 	for (;;){
 		p0 = h_tree_builder_peek0(htb);
 		p1 = h_tree_builder_peek1(htb);
@@ -300,3 +308,97 @@ static unsigned int h_tree_builder_score_helper(const struct h_tree_builder* htb
 unsigned int h_tree_builder_score(const struct h_tree_builder* htb){
 	return h_tree_builder_score_helper(htb, htb->head.tree + htb->t1 - 1, 1);
 }
+
+static void h_tree_builder_lens_helper(const struct h_tree_builder* htb, const struct h_tree_node* htn, int depth, unsigned int* count){
+	if (htn->left < 0){
+		count[depth]++;
+	}
+	else{
+		h_tree_builder_lens_helper(htb, htb->head.tree + htn->left, depth + 1, count);
+	}
+	if (htn->right < 0){
+		count[depth]++;
+	}
+	else{
+		h_tree_builder_lens_helper(htb, htb->head.tree + htn->right, depth + 1, count);
+	}
+}
+
+/* Fill 'lens' (indexed by val; 'htb->cap' entries) with the code lengths of the h_tree in h_tree_builder 'htb',
+	limited to 'max_len' bits, so that they can be turned into canonical Huffman codes (3.2.2)
+	Only the number of leaves at each depth is taken from the tree. Leaves deeper than 'max_len' are pulled up to 'max_len',
+		and then leaves are pushed down from the deepest shallower level until the code is no longer oversubscribed.
+	The lengths are then handed out shortest first in order of decreasing weight, which the sorted queue already provides.
+	The tree must have at least two leaves
+*/
+void h_tree_builder_lens(const struct h_tree_builder* htb, unsigned char* lens, int max_len){
+	int n = (htb->cap > max_len)? htb->cap : max_len; // deepest possible depth
+	unsigned int count[n + 1]; // number of leaves at each depth
+	unsigned long long kraft = 0; // sum of 2^(max_len - depth) over all leaves
+	int i, d;
+	memset(lens, 0, htb->cap * sizeof(unsigned char));
+	memset(count, 0, (n + 1) * sizeof(unsigned int));
+	h_tree_builder_lens_helper(htb, htb->head.tree + htb->t1 - 1, 1, count);
+	for (d = n; d > max_len; d--){
+		count[max_len] += count[d];
+		count[d] = 0;
+	}
+	for (d = max_len; d > 0; d--){
+		kraft += (unsigned long long)count[d] << (max_len - d);
+	}
+	while (kraft > (1ULL << max_len)){
+		count[max_len]--;
+		for (d = max_len - 1; d > 0; d--){
+			if (count[d]){
+				count[d]--;
+				count[d + 1] += 2;
+				break;
+			}
+		}
+		kraft--;
+	}
+	for (i = htb->cap - 1, d = 1; i >= 0 && htb->q[i].weight; i--){
+		while (!count[d]){
+			d++;
+		}
+		lens[htb->q[i].val] = d;
+		count[d]--;
+	}
+}
+
+// Run-length encode the 'n' code lengths in 'lens' with the code length alphabet (0 - 18) of 3.2.7
+//	Each resulting symbol is put in 'syms' and its extra bits value (0 for 0 - 15) in 'extra'
+//	Returns the number of symbols, which is at most 'n'
+int h_tree_rle_lens(const unsigned char* lens, int n, unsigned char* syms, unsigned char* extra){
+	int i, j, k, run, t;
+	for (i = k = 0; i < n; i = j){
+		for (j = i + 1; j < n && lens[j] == lens[i]; j++);
+		run = j - i;
+		if (lens[i] == 0){
+			for (; run >= 11; run -= t, k++){ // 18
+				t = min(run, 138);
+				syms[k] = 18;
+				extra[k] = t - 11;
+			}
+			if (run >= 3){ // 17
+				syms[k] = 17;
+				extra[k++] = run - 3;
+				run = 0;
+			}
+		}
+		else{
+			syms[k] = lens[i];
+			extra[k++] = 0;
+			for (run--; run >= 3; run -= t, k++){ // 16
+				t = min(run, 6);
+				syms[k] = 16;
+				extra[k] = t - 3;
+			}
+		}
+		for (; run > 0; run--, k++){
+			syms[k] = lens[i];
+			extra[k] = 0;
+		}
+	}
+	return k;
+}
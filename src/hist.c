@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "include/globals.h"
+#include "include/global_errors.h"
+#include "include/hist.h"
+
+static unsigned int hist_log2[1 << HIST_LOG2_BITS]; // log2 of each index with HIST_FRAC fraction bits (0 for 0)
+unsigned int hist_step[1 << HIST_LOG2_BITS];
+
+// log2('x') with HIST_FRAC fraction bits, for 'x' > 0, one bit at a time by squaring the mantissa
+static unsigned int log2_fixed(unsigned int x){
+	int k = 31 - __builtin_clz(x), b;
+	unsigned int ret = k << HIST_FRAC;
+	unsigned long long y = ((unsigned long long)x << 31) >> k; // x / 2^k in [1, 2), with 31 fraction bits
+	for (b = HIST_FRAC - 1; b >= 0; b--){
+		y = (y * y) >> 31;
+		if (y >> 32){ // 2 or more
+			y >>= 1;
+			ret |= 1U << b;
+		}
+	}
+	return ret;
+}
+
+// x * log2(x) with HIST_FRAC fraction bits; past the table, log2 is taken of 'x' shifted into it, which is off by well under a thousandth of a bit
+static inline unsigned long long xlog2x(unsigned int x){
+	int s = 0;
+	if (x >> HIST_LOG2_BITS){
+		s = 32 - HIST_LOG2_BITS - __builtin_clz(x);
+	}
+	return (unsigned long long)x * (hist_log2[x >> s] + ((unsigned int)s << HIST_FRAC));
+}
+
+// Fill in the log2 tables, once; hist_init does so, but threads that set up histograms at once should have it done before them
+void hist_tables_init(){
+	static int done = 0;
+	int x;
+	if (done)
+		return;
+	for (x = 1; x < (1 << HIST_LOG2_BITS); x++){
+		hist_log2[x] = log2_fixed(x);
+	}
+	for (x = 0; x < (1 << HIST_LOG2_BITS) - 1; x++){
+		hist_step[x] = xlog2x(x + 1) - xlog2x(x);
+	}
+	done = 1;
+}
+
+// Initialize the histogram 'h' over 'sz' symbols
+void hist_init(struct hist* h, int sz){
+	hist_tables_init();
+	if (!(h->freq = malloc(sz * sizeof(unsigned int)))){
+		fail_out(E_MALLOC);
+	}
+	h->sz = sz;
+	hist_reset(h);
+}
+
+void hist_deinit(struct hist* h){
+	freec(h->freq);
+}
+
+// Empty the histogram 'h' of all the symbols inserted so far
+void hist_reset(struct hist* h){
+	memset(h->freq, 0, h->sz * sizeof(unsigned int));
+	h->n = 0;
+	h->used = 0;
+	h->flogf = 0;
+}
+
+// How much f * log2(f) grows by as 'f' goes up by one, for 'f' past hist_step (see hist_insert)
+unsigned long long hist_step_far(unsigned int f){
+	return xlog2x(f + 1) - xlog2x(f);
+}
+
+// Add the symbols in the histogram 'src' to 'h', over the same alphabet; O(the alphabet), not O(the symbols)
+void hist_merge(struct hist* h, const struct hist* src){
+	unsigned int f, g;
+	int c;
+	for (c = 0; c < h->sz; c++){
+		if ((g = src->freq[c])){
+			f = h->freq[c];
+			h->flogf += xlog2x(f + g) - xlog2x(f);
+			h->used += !f;
+			h->freq[c] = f + g;
+		}
+	}
+	h->n += src->n;
+}
+
+// Number of bits the symbols in the histogram 'h' take at their entropy, rounded to the nearest bit
+unsigned int hist_bits(const struct hist* h){
+	unsigned long long nlogn = xlog2x(h->n);
+	if (nlogn <= h->flogf){ // one symbol only, or none
+		return 0;
+	}
+	return (nlogn - h->flogf + (1U << (HIST_FRAC - 1))) >> HIST_FRAC;
+}
@@ -0,0 +1,39 @@
+#ifndef ADLER32_H
+#define ADLER32_H
+#include "globals.h"
+
+#define ADLER32_BASE 65521 // largest prime smaller than 65536
+#define ADLER32_NMAX 5552 // most bytes that can be summed before s2 may overflow 32 bits
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+
+// Continue the adler32 checksum 'a' over the memory segment at 'b' of length 'len'; a new checksum starts at 'a' = 1 (see rfc1950)
+static unsigned int adler32_update(unsigned int a, const unsigned char* b, size_t len){
+	unsigned int s1 = a & 0xffff, s2 = a >> 16;
+	size_t n;
+	while (len > 0){
+		n = min(len, ADLER32_NMAX);
+		len -= n;
+		for (; n > 0; n--){
+			s1 += *(b++);
+			s2 += s1;
+		}
+		s1 %= ADLER32_BASE;
+		s2 %= ADLER32_BASE;
+	}
+	return (s2 << 16) | s1;
+}
+
+// Combine the adler32 checksum 'a' of one segment and 'b' of the 'len' bytes after it into the checksum of both (as in zlib)
+//	Each of the 'len' bytes adds s1 of the first segment to s2 once more, which is all that changes
+static unsigned int adler32_combine(unsigned int a, unsigned int b, size_t len){
+	unsigned long long s1, s2, rem = len % ADLER32_BASE;
+	s1 = (a & 0xffff) + (b & 0xffff) + ADLER32_BASE - 1; // both s1s count the starting 1
+	s2 = (rem * (a & 0xffff)) % ADLER32_BASE + (a >> 16) + (b >> 16) + ADLER32_BASE - rem;
+	return ((s2 % ADLER32_BASE) << 16) | (s1 % ADLER32_BASE);
+}
+
+#pragma GCC diagnostic pop
+
+#endif
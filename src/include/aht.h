@@ -33,6 +33,7 @@ struct aht{
 
 void aht_init(struct aht* aht, int sz);
 void aht_deinit(struct aht* aht);
+void aht_reset(struct aht* aht);
 void aht_insert(struct aht* aht, int c);
 void aht_print(const struct aht* aht);
 
@@ -0,0 +1,65 @@
+/* Bit writer
+	Bits are packed LSB first (see rfc1951 3.1.1) into the 64-bit accumulator 'acc'.
+	Once 'acc' fills up, the whole word is stored into the output buffer 'buf' in one go,
+		and 'buf' is only handed to write() once it is full, so 'fd' sees large batches rather than a write per symbol.
+	With no 'fd' (-1), 'buf' grows instead, so that it ends up holding the whole output, unless it is a fixed buffer of the
+		caller's (see bit_writer_init_buf), which fails with E_SZ once full.
+	Since Huffman codes are packed starting with their MSB, they must be handed to bit_writer_put already bit-reversed.
+*/
+
+#ifndef BIT_WRITER_H
+#define BIT_WRITER_H
+#include <string.h>
+
+#define BIT_WRITER_BUF_SZ (1 << 17)
+
+struct bit_writer{
+	unsigned long long acc; // pending bits, starting at the low end
+	int n; // number of pending bits in 'acc'
+	int fd; // where 'buf' is written once full (-1 for none)
+	unsigned char* buf; // output buffer of 'cap' bytes
+	size_t pos; // number of bytes stored in 'buf'
+	size_t cap; // size of 'buf'; BIT_WRITER_BUF_SZ unless it has grown or is fixed
+	unsigned char fixed; // bool, 'buf' is the caller's and cannot grow
+	size_t total; // number of bytes written to 'fd' so far
+};
+
+void bit_writer_init(struct bit_writer* bw, int fd);
+void bit_writer_init_buf(struct bit_writer* bw, unsigned char* buf, size_t cap);
+void bit_writer_deinit(struct bit_writer* bw);
+void bit_writer_flush(struct bit_writer* bw);
+void bit_writer_align(struct bit_writer* bw);
+void bit_writer_bytes(struct bit_writer* bw, int n);
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+
+// Store the full accumulator of 'bw' into its output buffer
+static inline void bit_writer_word(struct bit_writer* bw){
+	if (bw->pos + sizeof(bw->acc) > bw->cap){
+		bit_writer_flush(bw);
+		if (bw->fixed){ // no room for a whole word at its end
+			bit_writer_bytes(bw, sizeof(bw->acc));
+			return;
+		}
+	}
+	memcpy(bw->buf + bw->pos, &bw->acc, sizeof(bw->acc)); // little endian, like _bits32
+	bw->pos += sizeof(bw->acc);
+}
+
+// Append the low 'len' (up to 64) bits of 'bits' to 'bw'; no bits of 'bits' may be set at or above 'len'
+static inline void bit_writer_put(struct bit_writer* bw, unsigned long long bits, int len){
+	bw->acc |= bits << bw->n;
+	if (bw->n + len >= 64){ // accumulator is full
+		bit_writer_word(bw);
+		bw->acc = (bw->n)? bits >> (64 - bw->n) : 0; // the bits that did not fit
+		bw->n += len - 64;
+	}
+	else{
+		bw->n += len;
+	}
+}
+
+#pragma GCC diagnostic pop
+
+#endif
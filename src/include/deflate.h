@@ -4,5 +4,6 @@
 #define MAXLEN 258
 #define NUM_LITLEN_CODES 286 // lit: 0 - 255; eof: 256; len: 257 - 285;
 #define NUM_DIST_CODES 30
+#define NUM_FIXED_LITLEN_CODES 288 // the fixed Huffman code (3.2.6) also has 286 and 287, which never occur
 
 #endif
\ No newline at end of file
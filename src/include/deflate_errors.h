@@ -44,7 +44,7 @@ const static unsigned char deflate_errors[NUM_DEFLATE_ERRORS + 1][ERROR_NAME_LEN
 #define fail_out(e) \
 	do{ \
 		if (((e) & ERROR_CLEAR_MASK) == DEFLATE_ERROR_MASK) \
-			do_fail_out(e, deflate_errors[e]); \
+			do_fail_out(e, deflate_errors[(e) - DEFLATE_ERROR_MASK]); \
 		else \
 			do_fail_out(e, global_errors[e]); \
 	} while(0)
@@ -4,30 +4,91 @@
 #include <stdio.h>
 #include "globals.h"
 #define DEFLATE_NULLTERM 1
+#define DEFLATE_BT 2 // compression: binary tree match finder
+#define DEFLATE_HIST 4 // compression: split blocks going by symbol histograms even with the optimal strategy or statistics, as the rest do; cheaper, less exact
+#define DEFLATE_DP_SPLIT 8 // compression: end blocks where they take the fewest bits in all over a large buffer of symbols, by dynamic programming; slow
+#define DEFLATE_AHT 16 // compression: split blocks going by adaptive Huffman trees, as the optimal strategy does, whatever the strategy; slower
+
+#define DEFLATE_STREAM_END (-1) // deflate_decompr_stream_push: the whole stream has been decompressed; deflate_compr_push: written out
+
+// Flush modes of deflate_compr_push
+#define DEFLATE_NO_FLUSH 0
+#define DEFLATE_SYNC_FLUSH 1
+#define DEFLATE_FINISH 2
+
+#define DEFLATE_MAX_LEVEL 9
+#define DEFLATE_LEVEL_DEFAULT 6
+#define DEFLATE_CHUNK_SZ (1 << 17) // default size of the chunks compressed by the worker threads of deflate_compress_parallel
+#define DEFLATE_SPEC_PART_MIN (1 << 16) // least compressed data deflate_decompress_parallel gives a thread of its own
+#define DEFLATE_SEEK_MAGIC 0x5a53454bU // "ZSEK", ends the seek table after a stream from deflate_compress_seekable
+
+// Strategies
+#define DEFLATE_DEFAULT 0 // match at a time, lazily or greedily per the level
+#define DEFLATE_OPTIMAL 1 // cheapest parse in bits of each sliding window; slow
+#define DEFLATE_FAST 2 // one probe per position, skipping ahead through incompressible input
+#define DEFLATE_RLE 3 // dup strings only a pixel back, without hash chains; for image and sparse data
+#define DEFLATE_HUFFMAN_ONLY 4 // literals only, Huffman coded by byte frequencies
 
 typedef unsigned short swi; // sliding window index
 
 typedef struct deflate_compr deflate_compr_t;
 SPAWNABLE_HEADER(deflate_compr_t);
+typedef struct deflate_decompr_stream deflate_decompr_stream_t;
+SPAWNABLE_HEADER(deflate_decompr_stream_t);
 
-void deflate_compr_init(deflate_compr_t* com, int fd_in, int fd_out, int fd_stats, swi sw);
+int deflate_compr_init(deflate_compr_t* com, int fd_in, int fd_out, int fd_stats, swi sw, int level, int strategy, int ops);
 void deflate_compr_deinit(deflate_compr_t* com);
+void deflate_compr_dict(deflate_compr_t* com, const unsigned char* dict, size_t len);
+int deflate_compr_push(deflate_compr_t* com, const unsigned char* in, size_t in_len, size_t* in_used, unsigned char* out, size_t out_cap, size_t* out_len, int flush);
+
+void deflate_decompr_stream_init(deflate_decompr_stream_t* ds, const struct string_len* dict);
+void deflate_decompr_stream_deinit(deflate_decompr_stream_t* ds);
+int deflate_decompr_stream_push(deflate_decompr_stream_t* ds, const unsigned char* in, size_t in_len, size_t* in_used, unsigned char* out, size_t out_cap, size_t* out_len);
 
 int deflate_decompress(struct string_len* decompr_dat, struct string_len* compr_dat, int ops);
-int deflate_compress(int fd_in, int fd_out, int fd_stats, swi sw, int ops);
+int deflate_decompress_parallel(struct string_len* decompr_dat, struct string_len* compr_dat, int ops, int threads);
+int deflate_compress(int fd_in, int fd_out, int fd_stats, swi sw, int level, int strategy, int ops);
+int deflate_decompress_dict(struct string_len* decompr_dat, struct string_len* compr_dat, const struct string_len* dict, int ops);
+int deflate_compress_dict(int fd_in, int fd_out, int fd_stats, swi sw, int level, int strategy, int ops, const struct string_len* dict);
+int deflate_compress_parallel(int fd_in, int fd_out, swi sw, int level, int strategy, int ops, int threads, size_t chunk_sz);
+int deflate_compress_buffer(const unsigned char* src, size_t len, unsigned char* dst, size_t cap, size_t* dst_len, int level);
+size_t deflate_compress_bound(size_t len);
+int deflate_dict_train(struct string_len* dict, const struct string_len* samples, int n, size_t cap);
+
+struct deflate_point{ // seek point of a deflate_index
+	size_t in; // byte of the compressed data where a block starts
+	int bit; // bit of that byte where it starts
+	size_t out; // number of bytes of output before it
+	size_t window_len; // number of them in 'window'
+	unsigned char* window; // the last sliding window of output before it (NULL if none)
+};
+
+struct deflate_index{ // seek points into zlib data, for decompressing any range of it (see deflate_index_build)
+	struct deflate_point* points; // amortized list, in order
+	unsigned int n; // number of seek points
+	size_t len; // length of the decompressed data
+	size_t sliding_window; // sliding window size from the zlib header
+};
+
+int deflate_index_build(struct deflate_index* idx, const struct string_len* compr_dat, size_t span);
+void deflate_index_free(struct deflate_index* idx);
+int deflate_index_extract(struct string_len* decompr_dat, const struct deflate_index* idx, const struct string_len* compr_dat, size_t off, size_t len);
+int deflate_compress_seekable(int fd_in, int fd_out, swi sw, int level, int strategy, int ops, int threads, size_t span);
+int deflate_seekable_index(struct deflate_index* idx, const struct string_len* compr_dat);
 
 struct compress_stats{
 	int bytes; // number of bytes processed
-	int tree_bits; // number of bits in trees
-	int ll_bits; // number of bits in lit/len compressed data
-	int d_bits; // number of bits in dist compressed data
+	int tree_bits; // number of bits in the trees of the current block
+	int ll_bits; // number of bits in its lit/len compressed data
+	int d_bits; // number of bits in its dist compressed data
 	int ll; // lit character or length
 	int d; // 0 or distance
 	
 	// check d to see whether this is a literal (d == 0) or len/dist pair (d != 0)
+	// the bits start over where a block ends, with the symbols buffered past that point (see deflate_block_split)
 	
 	// bits from compressed data only = ll_bits + d_bits
-	// rate = (double)(tree_bits + ll_bits + d_bits) / bytes
+	// rate of the current block = (double)(tree_bits + ll_bits + d_bits) / (bytes since it started)
 };
 
 #endif
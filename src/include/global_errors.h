@@ -1,7 +1,7 @@
 /*
 This is a checkpointing system.
 The source file "error_checkpoint.c" establishes an array of MAX_CHECKPOINTS checkpoints.
-Checkpoints are made with the fail_checkpoint() function:
+Checkpoints are made with the fail_checkpoint() macro:
 	0 is returned when the checkpoint is first made.
 	When an error occurs, use the fail_out() macro, passing the relevant error constant.
 		The control flow then jumps to the most recent fail_checkpoint() call, returning this time the supplied error constant.
@@ -20,7 +20,7 @@ The most recent checkpoint is taken down with the fail_uncheckpoint() function.
 #define ERROR_CLEAR_MASK (127U << 24)
 
 #define ERROR_NAME_LEN 8 // length of error names (without \0)
-#define NUM_GLOBAL_ERRORS 12 // length of the following errors list // TODO
+#define NUM_GLOBAL_ERRORS 14 // length of the following errors list // TODO
 #define E_LEN    1  // Improper length
 #define E_MALLOC 2  // Malloc failed
 #define E_FORK   3  // Fork failed
@@ -33,6 +33,8 @@ The most recent checkpoint is taken down with the fail_uncheckpoint() function.
 #define E_RANGE  10 // Out of range
 #define E_INVAL  11 // Invalid
 #define E_RESERV 12 // Reserved
+#define E_READ   13 // Read failed
+#define E_WRITE  14 // Write failed
 
 const static unsigned char global_errors[NUM_GLOBAL_ERRORS + 1][ERROR_NAME_LEN + 1] = {
 	[E_LEN   ] = "E_LEN   ",
@@ -47,6 +49,8 @@ const static unsigned char global_errors[NUM_GLOBAL_ERRORS + 1][ERROR_NAME_LEN +
 	[E_RANGE ] = "E_RANGE ",
 	[E_INVAL ] = "E_INVAL ",
 	[E_RESERV] = "E_RESERV",
+	[E_READ  ] = "E_READ  ",
+	[E_WRITE ] = "E_WRITE ",
 	// TODO
 };
 
@@ -58,15 +62,16 @@ static void print_error(const unsigned char* m, const char* file, int line){
 }
 
 #define MAX_CHECKPOINTS 10
-extern int checkpoint_stack;
-extern jmp_buf checkpoints[MAX_CHECKPOINTS];
-static int fail_checkpoint(){
+extern _Thread_local int checkpoint_stack; // each thread has its own checkpoints
+extern _Thread_local jmp_buf checkpoints[MAX_CHECKPOINTS];
+static inline void fail_checkpoint_push(){
 	if (++checkpoint_stack == MAX_CHECKPOINTS){
 		fprintf(stderr, "Checkpoint stack full\n");
 		exit(1);
 	}
-	return setjmp(checkpoints[checkpoint_stack]);
 }
+// setjmp has to be called from the function that sets the checkpoint, not one that has returned by the time fail_out jumps to it
+#define fail_checkpoint() (fail_checkpoint_push(), setjmp(checkpoints[checkpoint_stack]))
 
 static inline void fail_uncheckpoint(){
 	checkpoint_stack--;
@@ -9,13 +9,14 @@
 #define STR(x) #x
 
 #define min(a, b) (((a) < (b))? (a) : (b))
+#define max(a, b) (((a) > (b))? (a) : (b))
 #define closec(x) do {close(x); (x) = 0;} while (0)
 #define freec(x) do {free(x); (x) = NULL;} while (0)
 
 #define bit_inc(byte, bit, n) do{(byte) += ((bit) + (n)) / 8; (bit) = ((bit) + (n)) % 8;} while (0)
 #define byte_inc(byte, bit, n) do{(byte) += (n); (bit) = 0;} while (0)
 #define byte_roundup(byte, bit) if (bit) do{(byte)++; (bit) = 0;} while (0)
-#define MASK(val, a, b) ((*(1ULL << (b)) - 1) & (val)) >> (a))
+#define MASK(val, a, b) ((((1ULL << (b)) - 1) & (val)) >> (a))
 
 #define SPAWNABLE_HEADER(t) t* spawn_##t()
 
@@ -68,18 +69,19 @@ static inline unsigned int read_bits32(unsigned char** byte, int* bit, int len){
 // Automatically double the list's space if its capacity is reached
 static int a_list_add(void** list, unsigned int* len, size_t elm_sz){
 	if (!(*len & (*len - 1)))
-		if ((*list = realloc(*list, *len * elm_sz << 1)) == NULL)
+		if ((*list = realloc(*list, (*len)? *len * elm_sz << 1 : elm_sz)) == NULL)
 			return E_MALLOC;
-	memset(*list + *len, 0, elm_sz); // clear new elm
+	memset((char*)*list + *len * elm_sz, 0, elm_sz); // clear new elm
 	(*len)++;
 	return 0;
 }
 
+// Reverse the order of the low 'len' bits of 'x'
 static int reverse_bits(int x, int len){
 	int f;
 	for (f = 0; len > 0; len--){
-		f |= (x & 1);
 		f <<= 1;
+		f |= (x & 1);
 		x >>= 1;
 	}
 	return f;
@@ -26,6 +26,7 @@ struct h_tree_node{ // members are indices into the 'tree' member of h_tree_head
 struct h_tree_head{
 	struct h_tree_node* tree;
 	int sz; // sz of H_TREE_SZ_FL means fixed Huffman tree for literal/length, H_TREE_SZ_FD means fixed Huffman tree for distance, else dynamic Huffman tree
+	int cap; // number of nodes 'tree' has room for
 };
 
 struct htbq{
@@ -45,7 +46,7 @@ struct hlit_hdist_hclen{
 
 void h_tree_init(struct h_tree_head* h, int sz);
 void h_tree_deinit(struct h_tree_head* h);
-int h_tree_lookup(struct h_tree_head* h, unsigned char** byte, int* bit);
+int h_tree_lookup(const struct h_tree_head* h, unsigned char** byte, int* bit);
 void h_tree_add(struct h_tree_head* h, h_code c, int codelen, int val);
 void h_tree_builder_init(struct h_tree_builder* htb, int sz);
 void h_tree_builder_deinit(struct h_tree_builder* htb);
@@ -53,5 +54,7 @@ void h_tree_builder_reset(struct h_tree_builder* htb);
 void h_tree_builder_build(struct h_tree_builder* htb);
 unsigned int h_tree_builder_score(const struct h_tree_builder* htb);
 int h_tree_d_lens(struct htbq* htn, const struct aht* aht0, const struct aht* aht1, struct hlit_hdist_hclen* ldc);
+void h_tree_builder_lens(const struct h_tree_builder* htb, unsigned char* lens, int max_len);
+int h_tree_rle_lens(const unsigned char* lens, int n, unsigned char* syms, unsigned char* extra);
 
 #endif
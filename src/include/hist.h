@@ -0,0 +1,43 @@
+/* Symbol histogram with an entropy estimate, a cheap stand-in for an aht where only the cost of the symbols matters
+
+Each insert counts the symbol and keeps the sum of f * log2(f) over the frequencies f up to date in fixed point, with
+	log2 looked up in a table, so the number of bits the symbols take at their entropy, n * log2(n) - sum(f * log2(f)),
+	is had in O(1) at any time. That is a lower bound on what a Huffman code of them takes (a few percent under, usually).
+	An insert takes one lookup in a table of the steps of f * log2(f), short of frequencies in the thousands. Histograms
+	of consecutive runs of symbols merge into the histogram of them all (see hist_merge).
+
+*/
+
+#ifndef HIST_H
+#define HIST_H
+
+#define HIST_FRAC 16 // number of fraction bits of the fixed point log2 values
+#define HIST_LOG2_BITS 12 // log2 of the number of entries of the log2 table; larger values are shifted into it
+
+struct hist{
+	unsigned int* freq; // frequency of each symbol
+	int sz; // number of symbols in the alphabet
+	unsigned int n; // number of symbols inserted
+	int used; // number of symbols with a nonzero frequency
+	unsigned long long flogf; // sum of f * log2(f) over the frequencies, with HIST_FRAC fraction bits
+};
+
+extern unsigned int hist_step[1 << HIST_LOG2_BITS]; // how much f * log2(f) grows by as f goes up by one, for f below the size of the log2 table
+
+void hist_tables_init();
+void hist_init(struct hist* h, int sz);
+void hist_deinit(struct hist* h);
+void hist_reset(struct hist* h);
+unsigned long long hist_step_far(unsigned int f);
+void hist_merge(struct hist* h, const struct hist* src);
+unsigned int hist_bits(const struct hist* h);
+
+// Count symbol 'c' in the histogram 'h'
+static inline void hist_insert(struct hist* h, int c){
+	unsigned int f = h->freq[c]++;
+	h->flogf += (f < (1 << HIST_LOG2_BITS) - 1)? hist_step[f] : hist_step_far(f);
+	h->used += !f;
+	h->n++;
+}
+
+#endif
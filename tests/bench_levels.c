@@ -0,0 +1,125 @@
+/* Prints the speed/ratio curve of the compression levels on the files given, one after another
+	They are copied into a temporary file, so that a mixed corpus can be made up of files of different kinds; that is
+	compressed REPS times (default 20) at each level so that the timing is stable, and the compressed output goes to another
+	temporary file so that its size can be measured.
+	Each level is run with both match finders, hash chains ("chain") and binary trees ("bt"), followed by the other
+	strategies: "opt" (optimal, at the maximum level), "fast", "rle", and "huff".
+	The block splitters come next, at the maximum level: "aht" splits by the adaptive Huffman tree cost model (DEFLATE_AHT)
+	rather than the histogram one, "dp" and "opt_dp" (with the optimal strategy) by dynamic programming (DEFLATE_DP_SPLIT).
+	Last, the default level is run on 1, 2, 4, and 8 threads ("par1" and so on; see deflate_compress_parallel), in chunks
+	of DEFLATE_CHUNK_SZ, or smaller ones (down to 4 KB) so that the input splits into at least PAR_CHUNKS of them.
+	Build it with `make bench_levels`, which links it against library objects of its own built with -O2 and without _DEBUG.
+	results/levels.txt is the output of
+		./bench_levels -r 10 test_files/original/bee_movie_script.txt src/[a-z]*.c src/include/[a-z]*.h \
+			results/sunrise.px results/sunrise1.px util/sunset.png data/aht.xlsx
+	that is, text, C, raw pixels, and already compressed data, about 900 KB in all.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "../src/include/globals.h"
+#include "../src/include/deflate_ext.h"
+
+const static int SLIDING_WINDOW = 1 << 15;
+const static int PAR_CHUNKS = 16;
+
+static int fd_in, fd_out, reps = 20;
+static size_t chunk_sz; // for deflate_compress_parallel
+static struct stat st;
+
+static double now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Compress the file 'reps' times with the given parameters and print a row named 'name'; 'threads' of 0 means deflate_compress
+static void bench(const char* name, int level, int strategy, int ops, int threads){
+	int r;
+	off_t out_sz;
+	double t;
+	t = now();
+	for (r = 0; r < reps; r++){
+		lseek(fd_in, 0, SEEK_SET);
+		lseek(fd_out, 0, SEEK_SET);
+		ftruncate(fd_out, 0);
+		if ((threads)? deflate_compress_parallel(fd_in, fd_out, SLIDING_WINDOW, level, strategy, ops, threads, chunk_sz)
+			: deflate_compress(fd_in, fd_out, -1, SLIDING_WINDOW, level, strategy, ops)){
+			fprintf(stderr, "%s failed\n", name);
+			exit(1);
+		}
+	}
+	t = now() - t;
+	out_sz = lseek(fd_out, 0, SEEK_CUR);
+	printf("%s, %s, %ld, %ld, %f, %f\n", name, (ops & DEFLATE_BT)? "bt" : "chain", (long)st.st_size, (long)out_sz,
+		(double)out_sz / st.st_size, st.st_size * reps / t / 1e6);
+}
+
+// Append the file 'path' to 'fd_in'
+static void add_file(const char* path){
+	int fd;
+	ssize_t n;
+	char buf[1 << 16];
+	if ((fd = open(path, O_RDONLY)) < 0){
+		fprintf(stderr, "%s: no such file\n", path);
+		exit(1);
+	}
+	while ((n = read(fd, buf, sizeof(buf))) > 0){
+		if (write(fd_in, buf, n) != n){
+			fprintf(stderr, "Could not copy %s\n", path);
+			exit(1);
+		}
+	}
+	close(fd);
+}
+
+int main(int argc, char* argv[]){
+	int level, threads, i = 1;
+	char name[8];
+	if (argc > 2 && !strcmp(argv[1], "-r")){
+		if ((reps = atoi(argv[2])) <= 0){
+			fprintf(stderr, "Invalid reps\n");
+			exit(1);
+		}
+		i = 3;
+	}
+	if (i >= argc){
+		fprintf(stderr, "USAGE: %s [-r REPS] FILE...\n", argv[0]);
+		exit(1);
+	}
+	fd_in = fileno(tmpfile());
+	for (; i < argc; i++){
+		add_file(argv[i]);
+	}
+	fstat(fd_in, &st);
+	fd_out = fileno(tmpfile());
+	printf("level, match_finder, bytes, compressed_bytes, ratio, MB/s\n");
+	for (level = 1; level <= DEFLATE_MAX_LEVEL; level++){
+		sprintf(name, "%d", level);
+		bench(name, level, DEFLATE_DEFAULT, 0, 0);
+		bench(name, level, DEFLATE_DEFAULT, DEFLATE_BT, 0);
+	}
+	bench("opt", DEFLATE_MAX_LEVEL, DEFLATE_OPTIMAL, 0, 0);
+	bench("opt", DEFLATE_MAX_LEVEL, DEFLATE_OPTIMAL, DEFLATE_BT, 0);
+	bench("fast", 1, DEFLATE_FAST, 0, 0);
+	bench("rle", 1, DEFLATE_RLE, 0, 0);
+	bench("huff", 1, DEFLATE_HUFFMAN_ONLY, 0, 0);
+	bench("aht", DEFLATE_MAX_LEVEL, DEFLATE_DEFAULT, DEFLATE_AHT, 0);
+	bench("aht", DEFLATE_MAX_LEVEL, DEFLATE_DEFAULT, DEFLATE_AHT | DEFLATE_BT, 0);
+	bench("dp", DEFLATE_MAX_LEVEL, DEFLATE_DEFAULT, DEFLATE_DP_SPLIT, 0);
+	bench("dp", DEFLATE_MAX_LEVEL, DEFLATE_DEFAULT, DEFLATE_DP_SPLIT | DEFLATE_BT, 0);
+	bench("opt_dp", DEFLATE_MAX_LEVEL, DEFLATE_OPTIMAL, DEFLATE_DP_SPLIT, 0);
+	bench("opt_dp", DEFLATE_MAX_LEVEL, DEFLATE_OPTIMAL, DEFLATE_DP_SPLIT | DEFLATE_BT, 0);
+	chunk_sz = min(DEFLATE_CHUNK_SZ, max(st.st_size / PAR_CHUNKS, 1 << 12));
+	for (threads = 1; threads <= 8; threads <<= 1){
+		sprintf(name, "par%d", threads);
+		bench(name, DEFLATE_LEVEL_DEFAULT, DEFLATE_DEFAULT, 0, threads);
+	}
+	close(fd_in);
+	close(fd_out);
+}
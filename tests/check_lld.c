@@ -8,12 +8,12 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
-#include <wait.h>
+#include <fcntl.h>
+#include <sys/wait.h>
 #include <signal.h>
 #include "../src/include/globals.h"
 #include "../src/include/global_errors.h"
 #include "../src/include/deflate_ext.h"
-#include "../src/include/h_tree.h"
 
 const static int SLIDING_WINDOW = 1 << 15;
 
@@ -45,24 +45,26 @@ static void do_parent(int pid, int f){
 		goto fail;
 	}
 	while (read(f, &cs, sizeof(cs)) > 1){
-		do_write(out_buf, cs.ll, cs.dist);
+		do_write(out_buf, cs.ll, cs.d);
 	}
+	free(out_buf);
+	close(f);
 	return;
 fail:
 	close(f);
 	kill(pid, SIGKILL);
 }
 
-static void do_test(deflate_compr_t* com, struct h_tree_builder* htb, int fd_in){
-	int f;
+static int do_test(int fd_in){
+	int f, fd_null;
 	int p[2];
 	
 	if (pipe(p) < 0){
-		fail_out(E_PIPE);
+		return E_PIPE;
 	}
 	f = fork();
 	if (f < 0){
-		fail_out(E_FORK);
+		return E_FORK;
 	}
 	if (f){
 		close(p[1]);
@@ -71,11 +73,13 @@ static void do_test(deflate_compr_t* com, struct h_tree_builder* htb, int fd_in)
 	}
 	else{
 		close(p[0]);
-		deflate_compress(fd_in, p[1], -1, SLIDING_WINDOW, 0) // TODO: wrong
+		fd_null = open("/dev/null", O_WRONLY); // only the statistics are of interest
+		deflate_compress(fd_in, fd_null, p[1], SLIDING_WINDOW, DEFLATE_LEVEL_DEFAULT, DEFLATE_DEFAULT, 0);
 		write(p[1], &f, 1); // single arbitrary byte to terminate parent read loop
 		close(p[1]);
 		exit(0);
 	}
+	return 0;
 }
 
 int main(int argc, char* argv[]){
@@ -89,6 +93,10 @@ int main(int argc, char* argv[]){
 		fprintf(stderr, "%s: no such file\n", argv[1]);
 		exit(1);
 	}
-	do_test(com, &htb, fd_in);
+	if (do_test(fd_in)){
+		fprintf(stderr, "%s: pipe or fork failed\n", argv[0]);
+		exit(1);
+	}
 	close(fd_in);
+	return 0;
 }
@@ -0,0 +1,362 @@
+/* Round trips through the memory and multithreaded APIs, checked against the decompressors
+	Every check that fails prints a line, and the exit status is the number of failures (0 if all pass). Built with _DEBUG,
+		each fail_out also prints a line on stderr, and the streaming and parallel decompressors fail out as a matter of
+		course (short input, and guesses at where blocks start), so stderr is best ignored.
+	The input is made up here: text with repeats at all distances, runs of one char, and stretches of random bytes, the
+		same on every run. Pieces and buffers are of random sizes, down to a single byte, so that every call has to
+		stop and pick up again in the middle of a symbol, a block, or a header.
+	- deflate_compr_push, with sync flushes: the output up to each one decompresses to exactly the input before it
+	- deflate_decompr_stream_push, a byte of input and output at a time
+	- deflate_compress_buffer, including empty and incompressible input, and too little room for the output
+	- deflate_compress_parallel on 1 and 3 threads, which must give the same output, and deflate_decompress_parallel
+	- deflate_compress_seekable and deflate_index_build, with ranges extracted through the index
+	- parameters out of range, which must come back as errors
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "../src/include/globals.h"
+#include "../src/include/deflate_errors.h"
+#include "../src/include/deflate_ext.h"
+
+const static int SLIDING_WINDOW = 1 << 15;
+const static size_t DATA_SZ = 300000;
+
+static int fails = 0;
+static unsigned int rnd_state = 1;
+
+// Count a failure, and say which check it was, unless 'ok'
+static void check(int ok, const char* what, size_t arg){
+	if (!ok){
+		printf("FAIL: %s (%zu)\n", what, arg);
+		fails++;
+	}
+}
+
+// Pseudorandom numbers, so that the input and the sizes are the same on every run
+static unsigned int rnd(){
+	rnd_state = rnd_state * 1103515245 + 12345;
+	return rnd_state >> 8;
+}
+
+// Fill the 'len' bytes at 'p' with the test input
+static void make_data(unsigned char* p, size_t len){
+	static const char* words[] = {"the ", "sliding ", "window ", "of ", "deflate ", "huffman ", "block ", "symbol ", "\n", "a "};
+	const char* w;
+	size_t i = 0, n, k;
+	while (i < len){
+		n = 1 + rnd() % 2000; // not in min(), which would take another number
+		n = min(len - i, n);
+		switch (rnd() % 8){
+		case 0: // incompressible
+			for (k = 0; k < n; k++){
+				p[i + k] = rnd();
+			}
+			break;
+		case 1: // a run
+			memset(p + i, rnd(), n);
+			break;
+		case 2: // a repeat from up to a sliding window back
+			if (i){
+				k = 1 + rnd() % min(i, SLIDING_WINDOW);
+				for (n = min(n, 258 * 4), k = i - k; n--; i++){
+					p[i] = p[k++];
+				}
+				continue;
+			} // else text
+		default: // text
+			for (k = 0; k < n; k += strlen(w)){
+				w = words[rnd() % 10];
+				memcpy(p + i + k, w, min(strlen(w), n - k));
+			}
+			break;
+		}
+		i += n;
+	}
+}
+
+// Read all of 'fd' from its start into 's'
+static void read_all(int fd, struct string_len* s){
+	ssize_t r;
+	size_t cap = 1 << 16;
+	s->str = malloc(cap);
+	s->len = 0;
+	lseek(fd, 0, SEEK_SET);
+	while (s->str && (r = read(fd, s->str + s->len, cap - s->len)) > 0){
+		s->len += r;
+		if (s->len == cap){
+			s->str = realloc(s->str, cap <<= 1);
+		}
+	}
+}
+
+// Write the 'len' bytes at 'p' to a new temporary file, and return its fd, at its start
+static int temp_fd(const unsigned char* p, size_t len){
+	int fd = fileno(tmpfile());
+	if (len && write(fd, p, len) != len){
+		fd = -1;
+	}
+	lseek(fd, 0, SEEK_SET);
+	return fd;
+}
+
+// Compress the 'len' bytes at 'src' into 'z' with deflate_compress; returns 0 or the error
+static int compress_fd(const unsigned char* src, size_t len, struct string_len* z){
+	int fd_in = temp_fd(src, len), fd_out = fileno(tmpfile()), ret;
+	ret = deflate_compress(fd_in, fd_out, -1, SLIDING_WINDOW, DEFLATE_LEVEL_DEFAULT, DEFLATE_DEFAULT, 0);
+	read_all(fd_out, z);
+	close(fd_in);
+	close(fd_out);
+	return ret;
+}
+
+// Whether the zlib data 'z' decompresses to the 'len' bytes at 'p'
+static int round_trips(struct string_len* z, const unsigned char* p, size_t len){
+	struct string_len out;
+	int ok;
+	if (deflate_decompress(&out, z, 0)){
+		return 0;
+	}
+	ok = out.len == len && !memcmp(out.str, p, len);
+	free(out.str);
+	return ok;
+}
+
+/* Decompress the first 'z_len' bytes of 'z' with deflate_decompr_stream_push, in pieces of up to 'in_max' bytes into an
+	output buffer of up to 'out_max' bytes; returns the number of bytes of output, which goes to the 'cap' bytes at 'out',
+	or -1 on an error, and sets '*end' to whether the stream ended
+*/
+static long stream_decompress(const unsigned char* z, size_t z_len, unsigned char* out, size_t cap, size_t in_max, size_t out_max, int* end){
+	deflate_decompr_stream_t* ds = spawn_deflate_decompr_stream_t();
+	size_t pos = 0, used, out_len, n = 0, in_len, out_cap;
+	int ret = 0, stall = 0;
+	deflate_decompr_stream_init(ds, NULL);
+	while (ret != DEFLATE_STREAM_END && stall < 4){
+		in_len = 1 + rnd() % in_max;
+		in_len = min(z_len - pos, in_len);
+		out_cap = 1 + rnd() % out_max;
+		out_cap = min(cap - n, out_cap);
+		if ((ret = deflate_decompr_stream_push(ds, z + pos, in_len, &used, out + n, out_cap, &out_len)) > 0){
+			break;
+		}
+		stall = (!used && !out_len)? stall + 1 : 0; // out of input (or stuck)
+		pos += used;
+		n += out_len;
+	}
+	deflate_decompr_stream_deinit(ds);
+	free(ds);
+	*end = ret == DEFLATE_STREAM_END;
+	return (ret > 0)? -1 : n;
+}
+
+// Push 'src' through deflate_compr_push in random pieces, with a sync flush after about one piece in 'sync_every'
+static void test_push(const unsigned char* src, size_t len, int level, int strategy, int ops, int sync_every){
+	deflate_compr_t* com = spawn_deflate_compr_t();
+	struct string_len z;
+	unsigned char* out;
+	size_t pos = 0, piece, used, out_len, out_cap, syncs[64][2];
+	int ret, flush, end, n_syncs = 0, i;
+	if ((ret = deflate_compr_init(com, -1, -1, -1, SLIDING_WINDOW, level, strategy, ops))){
+		check(0, "push: deflate_compr_init", ret);
+		free(com);
+		return;
+	}
+	out = malloc(len + 1);
+	z.str = malloc(len * 2 + 4096); // room for the sync flushes too
+	z.len = 0;
+	do{
+		piece = rnd() % 5000;
+		piece = min(len - pos, piece);
+		flush = (pos + piece == len)? DEFLATE_FINISH : (rnd() % sync_every == 0)? DEFLATE_SYNC_FLUSH : DEFLATE_NO_FLUSH;
+		for (;;){
+			out_cap = 1 + rnd() % 700;
+			ret = deflate_compr_push(com, src + pos, piece, &used, z.str + z.len, out_cap, &out_len, flush);
+			if (ret > 0 || used > piece || out_len > out_cap){
+				check(0, "push: deflate_compr_push", ret);
+				goto end;
+			}
+			pos += used;
+			piece -= used;
+			z.len += out_len;
+			if (ret == DEFLATE_STREAM_END || (flush == DEFLATE_NO_FLUSH && !piece) || (!piece && out_len < out_cap)){
+				break;
+			}
+		}
+		if (flush == DEFLATE_SYNC_FLUSH && n_syncs < 64){
+			syncs[n_syncs][0] = z.len;
+			syncs[n_syncs++][1] = pos;
+		}
+	} while (ret != DEFLATE_STREAM_END);
+	check(pos == len, "push: all input taken", pos);
+	check(round_trips(&z, src, len), "push: round trip", level);
+	for (i = 0; i < n_syncs; i++){ // everything before a sync flush comes out of what was written up to it
+		check(stream_decompress(z.str, syncs[i][0], out, len + 1, 1 << 16, 1 << 16, &end) == syncs[i][1]
+			&& !memcmp(out, src, syncs[i][1]), "push: output up to a sync flush", syncs[i][1]);
+	}
+end:
+	deflate_compr_deinit(com);
+	free(com);
+	free(z.str);
+	free(out);
+}
+
+// Decompress the compressed 'src' with deflate_decompr_stream_push a byte at a time, and in random pieces
+static void test_stream(const unsigned char* src, size_t len){
+	struct string_len z;
+	unsigned char* out = malloc(len + 1);
+	int end;
+	if (compress_fd(src, len, &z)){
+		check(0, "stream: deflate_compress", len);
+	}
+	else{
+		check(stream_decompress(z.str, z.len, out, len + 1, 1, 1, &end) == len && end && !memcmp(out, src, len), "stream: 1 byte at a time", len);
+		check(stream_decompress(z.str, z.len, out, len + 1, 3000, 3000, &end) == len && end && !memcmp(out, src, len), "stream: in pieces", len);
+		z.str[z.len / 2] ^= 0x10;
+		check(stream_decompress(z.str, z.len, out, len + 1, 1, 1, &end) < 0 || !end || memcmp(out, src, len), "stream: damaged input", len);
+	}
+	free(z.str);
+	free(out);
+}
+
+// Compress the 'len' bytes at 'src' with deflate_compress_buffer, with enough room and with too little
+static void test_buffer(const unsigned char* src, size_t len, int level){
+	struct string_len z;
+	size_t bound = deflate_compress_bound(len);
+	int ret;
+	z.str = malloc(bound);
+	ret = deflate_compress_buffer((len)? src : NULL, len, z.str, bound, &z.len, level);
+	check(!ret && z.len <= bound && round_trips(&z, src, len), "buffer: round trip", len);
+	if (!ret && z.len > 2){
+		check(deflate_compress_buffer(src, len, z.str, z.len - 1, &z.len, level) == E_SZ, "buffer: out of room", len);
+	}
+	free(z.str);
+}
+
+// Compress the 'len' bytes at 'src' with deflate_compress_parallel on 1 and 3 threads, and decompress it in parallel too
+static void test_parallel(const unsigned char* src, size_t len, int ops){
+	int fd_in = temp_fd(src, len), fd_out[2], threads[2] = {1, 3}, i;
+	struct string_len z[2], out;
+	for (i = 0; i < 2; i++){
+		fd_out[i] = fileno(tmpfile());
+		lseek(fd_in, 0, SEEK_SET);
+		check(!deflate_compress_parallel(fd_in, fd_out[i], SLIDING_WINDOW, DEFLATE_LEVEL_DEFAULT, DEFLATE_DEFAULT, ops, threads[i], 1 << 15),
+			"parallel: deflate_compress_parallel", threads[i]);
+		read_all(fd_out[i], z + i);
+		close(fd_out[i]);
+	}
+	check(z[0].len == z[1].len && !memcmp(z[0].str, z[1].str, z[0].len), "parallel: same output on 1 and 3 threads", len);
+	check(round_trips(z + 1, src, len), "parallel: round trip", len);
+	for (i = 1; i <= 4; i <<= 2){
+		out.str = NULL;
+		check(!deflate_decompress_parallel(&out, z + 1, 0, i) && out.len == len && !memcmp(out.str, src, len),
+			"parallel: deflate_decompress_parallel", i);
+		free(out.str);
+	}
+	free(z[0].str);
+	free(z[1].str);
+	close(fd_in);
+}
+
+// Extract a few ranges of the 'len' bytes at 'src' from its compressed data 'z' through the index 'idx'
+static void check_extracts(const struct deflate_index* idx, struct string_len* z, const unsigned char* src, size_t len, const char* what){
+	struct string_len out;
+	size_t ranges[8][2] = {{0, 0}, {0, len}, {len, 0}}, off, n;
+	int i;
+	for (i = 3; i < 8; i++){
+		ranges[i][0] = (len)? rnd() % len : 0;
+		ranges[i][1] = rnd() % 70000;
+		ranges[i][1] = min(len - ranges[i][0], ranges[i][1]);
+	}
+	for (i = 0; i < 8; i++){
+		off = ranges[i][0];
+		n = ranges[i][1];
+		check(!deflate_index_extract(&out, idx, z, off, n) && out.len == n && !memcmp(out.str, src + off, n), what, off);
+		free(out.str);
+	}
+	check(deflate_index_extract(&out, idx, z, len, 1) == E_RANGE, what, len + 1);
+	free(out.str);
+}
+
+// Index the zlib data of the 'len' bytes at 'src' from deflate_compress with deflate_index_build
+static void test_index(const unsigned char* src, size_t len){
+	struct string_len z;
+	struct deflate_index idx;
+	check(!compress_fd(src, len, &z), "index: deflate_compress", len);
+	check(!deflate_index_build(&idx, &z, 1 << 14) && idx.len == len, "index: deflate_index_build", len);
+	check_extracts(&idx, &z, src, len, "index: extract");
+	deflate_index_free(&idx);
+	free(z.str);
+}
+
+// Compress the 'len' bytes at 'src' with deflate_compress_seekable, and extract from it through its seek table
+static void test_seekable(const unsigned char* src, size_t len){
+	int fd_in = temp_fd(src, len), fd_out = fileno(tmpfile());
+	struct string_len z;
+	struct deflate_index idx;
+	check(!deflate_compress_seekable(fd_in, fd_out, SLIDING_WINDOW, DEFLATE_LEVEL_DEFAULT, DEFLATE_DEFAULT, 0, 2, 1 << 14),
+		"seekable: deflate_compress_seekable", len);
+	read_all(fd_out, &z);
+	check(round_trips(&z, src, len), "seekable: round trip", len);
+	check(!deflate_seekable_index(&idx, &z) && idx.n == max(1, (len + (1 << 14) - 1) >> 14) && idx.len == len,
+		"seekable: deflate_seekable_index", len);
+	check_extracts(&idx, &z, src, len, "seekable: extract");
+	deflate_index_free(&idx);
+	free(z.str);
+	close(fd_in);
+	close(fd_out);
+}
+
+// Parameters out of range come back as errors rather than failing out
+static void test_params(){
+	deflate_compr_t* com = spawn_deflate_compr_t();
+	unsigned char z[64];
+	size_t z_len;
+	check(deflate_compr_init(com, -1, -1, -1, 100, DEFLATE_LEVEL_DEFAULT, DEFLATE_DEFAULT, 0) == E_ZSLWIN, "params: sliding window", 100);
+	check(deflate_compr_init(com, -1, -1, -1, SLIDING_WINDOW, 0, DEFLATE_DEFAULT, 0) == E_RANGE, "params: level", 0);
+	check(deflate_compr_init(com, -1, -1, -1, SLIDING_WINDOW, 1, DEFLATE_HUFFMAN_ONLY + 1, 0) == E_RANGE, "params: strategy", 0);
+	check(deflate_compress_buffer(z, 1, z, sizeof(z), &z_len, DEFLATE_MAX_LEVEL + 1) == E_RANGE, "params: buffer level", 0);
+	check(deflate_compress_parallel(-1, -1, SLIDING_WINDOW, DEFLATE_LEVEL_DEFAULT, DEFLATE_DEFAULT, 0, 0, 0) == E_RANGE, "params: threads", 0);
+	free(com);
+}
+
+int main(int argc, char* argv[]){
+	unsigned char* data = malloc(DATA_SZ), * noise = malloc(1 << 16);
+	size_t i;
+	if (!data || !noise){
+		fprintf(stderr, "%s: out of memory\n", argv[0]);
+		exit(1);
+	}
+	make_data(data, DATA_SZ);
+	for (i = 0; i < 1 << 16; i++){
+		noise[i] = rnd();
+	}
+
+	test_push(data, DATA_SZ, DEFLATE_LEVEL_DEFAULT, DEFLATE_DEFAULT, 0, 4);
+	test_push(data, DATA_SZ, DEFLATE_MAX_LEVEL, DEFLATE_DEFAULT, DEFLATE_BT, 2);
+	test_push(data, DATA_SZ, DEFLATE_MAX_LEVEL, DEFLATE_OPTIMAL, DEFLATE_BT, 8);
+	test_push(data, DATA_SZ, DEFLATE_MAX_LEVEL, DEFLATE_OPTIMAL, DEFLATE_BT | DEFLATE_DP_SPLIT, 8);
+	test_push(data, 1000, 1, DEFLATE_FAST, 0, 1);
+	test_push(data, 0, DEFLATE_LEVEL_DEFAULT, DEFLATE_DEFAULT, 0, 1);
+	test_stream(data, DATA_SZ);
+	test_stream(data, 0);
+	test_buffer(data, DATA_SZ, DEFLATE_LEVEL_DEFAULT);
+	test_buffer(data, 0, DEFLATE_LEVEL_DEFAULT);
+	test_buffer(data, 1, 1);
+	test_buffer(noise, 1 << 16, DEFLATE_MAX_LEVEL);
+	test_parallel(data, DATA_SZ, 0);
+	test_parallel(data, DATA_SZ, DEFLATE_BT);
+	test_parallel(data, 0, 0);
+	test_index(data, DATA_SZ);
+	test_index(data, 0);
+	test_seekable(data, DATA_SZ);
+	test_seekable(data, 0);
+	test_params();
+
+	printf("%d failed\n", fails);
+	free(data);
+	free(noise);
+	return fails;
+}
+
@@ -0,0 +1,65 @@
+// Trains a preset dictionary on the files in a directory of sample messages and prints it; the optional argument specifies its maximum size (default 32768)
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "../../src/include/globals.h"
+#include "../../src/include/deflate_ext.h"
+
+int main(int argc, char* argv[]){
+	DIR* dir;
+	struct dirent* ent;
+	struct stat st;
+	FILE* f;
+	char path[4096];
+	struct string_len* samples = NULL, dict;
+	int n = 0, cap = 0, ret;
+	size_t max_sz = 1 << 15;
+	if (argc != 2 && argc != 3){
+		fprintf(stderr, "USAGE: %s DIR [max size]\n", argv[0]);
+		exit(1);
+	}
+	if (argc == 3 && ((max_sz = atoi(argv[2])) == 0 || max_sz > 1 << 15)){
+		fprintf(stderr, "Invalid max size\n");
+		exit(1);
+	}
+	if (!(dir = opendir(argv[1]))){
+		fprintf(stderr, "%s: no such directory\n", argv[1]);
+		exit(1);
+	}
+	while ((ent = readdir(dir))){
+		snprintf(path, sizeof(path), "%s/%s", argv[1], ent->d_name);
+		if (stat(path, &st) < 0 || !S_ISREG(st.st_mode) || !(f = fopen(path, "rb"))){
+			continue;
+		}
+		if (n == cap){
+			cap = (cap)? cap * 2 : 64;
+			if (!(samples = realloc(samples, cap * sizeof(struct string_len)))){
+				fprintf(stderr, "Out of memory\n");
+				exit(1);
+			}
+		}
+		if (!(samples[n].str = malloc(max(st.st_size, 1)))){
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		samples[n].len = fread(samples[n].str, 1, st.st_size, f);
+		fclose(f);
+		n++;
+	}
+	closedir(dir);
+	if ((ret = deflate_dict_train(&dict, samples, n, max_sz))){
+		fprintf(stderr, "Training failed (%d)\n", ret);
+		exit(1);
+	}
+	fwrite(dict.str, 1, dict.len, stdout);
+	fprintf(stderr, "%d samples, %zu byte dictionary\n", n, dict.len);
+	free(dict.str);
+	for (; n > 0; n--){
+		free(samples[n - 1].str);
+	}
+	free(samples);
+	return 0;
+}